@@ -40,6 +40,41 @@ USBManager::USBManager(USBDriver *driver, uint16_t vid, uint16_t pid, const char
     _pid = pid;
     _ifCount = 0;
     _epCount = 1;
+    _configDescriptor = NULL;
+    _configDescriptorLength = 0;
+    _otherSpeedDescriptor = NULL;
+    _otherSpeedDescriptorLength = 0;
+    _otherSpeed = false;
+    _builtHighSpeed = false;
+    _currentDevice = NULL;
+    memset(_inOwner, 0, sizeof(_inOwner));
+    memset(_outOwner, 0, sizeof(_outOwner));
+    memset(_ifOwner, 0, sizeof(_ifOwner));
+    _controlOwner = NULL;
+    _controlState = USB_CTL_IDLE;
+    _controlOutRemaining = 0;
+    _address = 0;
+    _configuration = 0;
+    _halted = 0;
+    memset(_altSetting, 0, sizeof(_altSetting));
+    _stringCount = 4;
+    _stringTable = NULL;
+    _events = NULL;
+    _eventHead = 0;
+    _eventTail = 0;
+    _eventOverflows = 0;
+    _eventHeld = 0;
+    _classHeld = 0;
+    _eventStale = 0;
+    _eventFlush = false;
+    _eventTask = -1;
+    initPools();
+    resetStatistics();
+    resetProfile();
+    clearTrace();
+    memset(_outSize, 0, sizeof(_outSize));
+    _periodicBytes = 0;
+    memset(_outTransfers, 0, sizeof(_outTransfers));
     _manufacturer = mfg;
     _product = prod;
     if (ser) {
@@ -58,6 +93,41 @@ USBManager::USBManager(USBDriver &driver, uint16_t vid, uint16_t pid, const char
     _pid = pid;
     _ifCount = 0;
     _epCount = 1;
+    _configDescriptor = NULL;
+    _configDescriptorLength = 0;
+    _otherSpeedDescriptor = NULL;
+    _otherSpeedDescriptorLength = 0;
+    _otherSpeed = false;
+    _builtHighSpeed = false;
+    _currentDevice = NULL;
+    memset(_inOwner, 0, sizeof(_inOwner));
+    memset(_outOwner, 0, sizeof(_outOwner));
+    memset(_ifOwner, 0, sizeof(_ifOwner));
+    _controlOwner = NULL;
+    _controlState = USB_CTL_IDLE;
+    _controlOutRemaining = 0;
+    _address = 0;
+    _configuration = 0;
+    _halted = 0;
+    memset(_altSetting, 0, sizeof(_altSetting));
+    _stringCount = 4;
+    _stringTable = NULL;
+    _events = NULL;
+    _eventHead = 0;
+    _eventTail = 0;
+    _eventOverflows = 0;
+    _eventHeld = 0;
+    _classHeld = 0;
+    _eventStale = 0;
+    _eventFlush = false;
+    _eventTask = -1;
+    initPools();
+    resetStatistics();
+    resetProfile();
+    clearTrace();
+    memset(_outSize, 0, sizeof(_outSize));
+    _periodicBytes = 0;
+    memset(_outTransfers, 0, sizeof(_outTransfers));
     _manufacturer = mfg;
     _product = prod;
     if (ser) {
@@ -76,6 +146,41 @@ USBManager::USBManager(USBDriver *driver, uint16_t vid, uint16_t pid) {
     _pid = pid;
     _ifCount = 0;
     _epCount = 1;
+    _configDescriptor = NULL;
+    _configDescriptorLength = 0;
+    _otherSpeedDescriptor = NULL;
+    _otherSpeedDescriptorLength = 0;
+    _otherSpeed = false;
+    _builtHighSpeed = false;
+    _currentDevice = NULL;
+    memset(_inOwner, 0, sizeof(_inOwner));
+    memset(_outOwner, 0, sizeof(_outOwner));
+    memset(_ifOwner, 0, sizeof(_ifOwner));
+    _controlOwner = NULL;
+    _controlState = USB_CTL_IDLE;
+    _controlOutRemaining = 0;
+    _address = 0;
+    _configuration = 0;
+    _halted = 0;
+    memset(_altSetting, 0, sizeof(_altSetting));
+    _stringCount = 4;
+    _stringTable = NULL;
+    _events = NULL;
+    _eventHead = 0;
+    _eventTail = 0;
+    _eventOverflows = 0;
+    _eventHeld = 0;
+    _classHeld = 0;
+    _eventStale = 0;
+    _eventFlush = false;
+    _eventTask = -1;
+    initPools();
+    resetStatistics();
+    resetProfile();
+    clearTrace();
+    memset(_outSize, 0, sizeof(_outSize));
+    _periodicBytes = 0;
+    memset(_outTransfers, 0, sizeof(_outTransfers));
     _manufacturer = "chipKIT";
     _product = _BOARD_NAME_;
     _serial = _defSerial;
@@ -97,6 +202,7 @@ void USBManager::populateDefaultSerial() {
     _defSerial[11] = D2H(DEVCFG3 >> 8);
     _defSerial[12] = D2H(DEVCFG3 >> 4);
     _defSerial[13] = D2H(DEVCFG3);
+    _defSerial[14] = 0;
 }
 
 USBManager::USBManager(USBDriver &driver, uint16_t vid, uint16_t pid) {
@@ -107,6 +213,41 @@ USBManager::USBManager(USBDriver &driver, uint16_t vid, uint16_t pid) {
     _pid = pid;
     _ifCount = 0;
     _epCount = 1;
+    _configDescriptor = NULL;
+    _configDescriptorLength = 0;
+    _otherSpeedDescriptor = NULL;
+    _otherSpeedDescriptorLength = 0;
+    _otherSpeed = false;
+    _builtHighSpeed = false;
+    _currentDevice = NULL;
+    memset(_inOwner, 0, sizeof(_inOwner));
+    memset(_outOwner, 0, sizeof(_outOwner));
+    memset(_ifOwner, 0, sizeof(_ifOwner));
+    _controlOwner = NULL;
+    _controlState = USB_CTL_IDLE;
+    _controlOutRemaining = 0;
+    _address = 0;
+    _configuration = 0;
+    _halted = 0;
+    memset(_altSetting, 0, sizeof(_altSetting));
+    _stringCount = 4;
+    _stringTable = NULL;
+    _events = NULL;
+    _eventHead = 0;
+    _eventTail = 0;
+    _eventOverflows = 0;
+    _eventHeld = 0;
+    _classHeld = 0;
+    _eventStale = 0;
+    _eventFlush = false;
+    _eventTask = -1;
+    initPools();
+    resetStatistics();
+    resetProfile();
+    clearTrace();
+    memset(_outSize, 0, sizeof(_outSize));
+    _periodicBytes = 0;
+    memset(_outTransfers, 0, sizeof(_outTransfers));
     _manufacturer = "chipKIT";
     _product = _BOARD_NAME_;
     _serial = _defSerial;
@@ -116,28 +257,375 @@ USBManager::USBManager(USBDriver &driver, uint16_t vid, uint16_t pid) {
 uint8_t USBManager::allocateInterface() {
     uint8_t i = _ifCount;
     _ifCount++;
+    if (i < USB_MAX_INTERFACES) {
+        _ifOwner[i] = _currentDevice;
+    }
+    return i;
+}
+
+// Find the device a class or vendor request is addressed to from the
+// recipient in bmRequestType and the interface or endpoint in wIndex.
+// Returns NULL for device (or other) recipient requests, which have
+// no single owner.
+USBDevice *USBManager::getRequestOwner(uint8_t *data) {
+    switch (data[0] & 0x1F) {
+        case 0x01: // Interface
+            if (data[4] < USB_MAX_INTERFACES) {
+                return _ifOwner[data[4]];
+            }
+            return NULL;
+        case 0x02: // Endpoint
+            if (data[4] & 0x80) {
+                return _inOwner[data[4] & 0x0F];
+            }
+            return _outOwner[data[4] & 0x0F];
+    }
+    return NULL;
+}
+
+// True if ep (an endpoint address, bit 7 set for IN) is EP0 or belongs to a device.
+bool USBManager::endpointExists(uint8_t ep) {
+    if ((ep & 0x70) != 0) return false;
+    if ((ep & 0x0F) == 0) return true;
+    if (ep & 0x80) {
+        return _inOwner[ep & 0x0F] != NULL;
+    }
+    return _outOwner[ep & 0x0F] != NULL;
+}
+
+bool USBManager::isHalted(uint8_t ep) {
+    return (_halted & (1UL << ((ep & 0x0F) + ((ep & 0x80) ? 16 : 0)))) != 0;
+}
+
+// Refuse the current control request.
+void USBManager::stallControl() {
+#ifdef USB_STATISTICS
+    _stats.ep[0].stalls++;
+#endif
+    traceEvent(USB_TRACE_STALL, 0, NULL, 0);
+    _controlState = USB_CTL_IDLE;
+    _driver->stallEndpoint(0);
+}
+
+// Called by the driver when the host resets the bus. The device drops back
+// to the default, unconfigured state.
+void USBManager::onBusReset() {
+#ifdef USB_STATISTICS
+    _stats.busResets++;
+#endif
+    traceEvent(USB_TRACE_RESET, 0, NULL, 0);
+    _address = 0;
+    _configuration = 0;
+    _halted = 0;
+    memset(_altSetting, 0, sizeof(_altSetting));
+    _controlState = USB_CTL_IDLE;
+    _controlOutRemaining = 0;
+    _controlOwner = NULL;
+
+    // The driver has resumed every endpoint
+    _eventHeld = 0;
+    _classHeld = 0;
+
+    // Anything still queued belongs to the old session. task() skips it.
+    if (_events) {
+        _eventStale = _eventHead;
+        _eventFlush = true;
+    }
+
+    for (uint8_t ep = 1; ep < 16; ep++) {
+        struct outTransfer *xfer = &_outTransfers[ep];
+        if (xfer->buffer != NULL) {
+            xfer->buffer = NULL;
+            if (xfer->callback) {
+                xfer->callback(ep, USB_TRANSFER_ABORTED, xfer->context);
+            }
+        }
+    }
+
+    // The driver has just found out what speed the host wants. If that
+    // isn't the speed the endpoints and descriptors were set up for, set
+    // them up again. With deferred events task() may be using them right
+    // now, so the rebuild is queued behind whatever it has still to do.
+    if ((_configDescriptor != NULL) && (_driver->isHighSpeed() != _builtHighSpeed)) {
+        if (!_events || !queueEvent(USB_EVENT_SPEED, 0, NULL, 0)) {
+            reconfigureSpeed();
+        }
+    }
+}
+
+// The descriptors come out the same length at either speed, so their
+// buffers are reused rather than allocated, which is safe in the interrupt.
+void USBManager::reconfigureSpeed() {
+    uint32_t s = disableInterrupts();
+    if (_driver->isHighSpeed() != _builtHighSpeed) {
+        _driver->resetEndpoints();
+        configureDevices();
+    }
+    restoreInterrupts(s);
+}
+
+// Take a consistent copy of the statistics.
+bool USBManager::getStatistics(struct USBStatistics *snapshot) {
+#ifdef USB_STATISTICS
+    uint32_t s = disableInterrupts();
+    memcpy(snapshot, &_stats, sizeof(struct USBStatistics));
+    restoreInterrupts(s);
+    return true;
+#else
+    memset(snapshot, 0, sizeof(struct USBStatistics));
+    return false;
+#endif
+}
+
+void USBManager::resetStatistics() {
+#ifdef USB_STATISTICS
+    uint32_t s = disableInterrupts();
+    memset(&_stats, 0, sizeof(struct USBStatistics));
+    restoreInterrupts(s);
+#endif
+}
+
+#ifdef USB_PROFILE
+// Record how long something took. Only ever called with interrupts off,
+// from the interrupt handler.
+void USBManager::profileEnd(uint8_t kind, uint8_t ep, uint32_t start) {
+    uint32_t ticks = _CP0_GET_COUNT() - start;
+    struct USBProfileEntry *e = &_profile[kind][ep & 0x0F];
+
+    if ((e->count == 0) || (ticks < e->min)) e->min = ticks;
+    if (ticks > e->max) e->max = ticks;
+    e->count++;
+
+    uint32_t bucket = (ticks < 64) ? 0 : (26 - __builtin_clz(ticks));
+    if (bucket >= USB_PROFILE_BUCKETS) bucket = USB_PROFILE_BUCKETS - 1;
+    e->histogram[bucket]++;
+}
+#endif
+
+bool USBManager::getProfile(uint8_t kind, uint8_t ep, struct USBProfileEntry *entry) {
+#ifdef USB_PROFILE
+    if ((kind < USB_PROF_KINDS) && (ep < 16)) {
+        uint32_t s = disableInterrupts();
+        memcpy(entry, &_profile[kind][ep], sizeof(struct USBProfileEntry));
+        restoreInterrupts(s);
+        return true;
+    }
+#endif
+    memset(entry, 0, sizeof(struct USBProfileEntry));
+    return false;
+}
+
+void USBManager::resetProfile() {
+#ifdef USB_PROFILE
+    uint32_t s = disableInterrupts();
+    memset(_profile, 0, sizeof(_profile));
+    restoreInterrupts(s);
+#endif
+}
+
+// Register a string for a device to reference from its descriptors.
+// Returns the string index to use, or 0 if the string table is full.
+uint8_t USBManager::allocateString(const char *str) {
+    if (_stringCount >= USB_MAX_STRINGS) {
+        return 0;
+    }
+    uint8_t i = _stringCount;
+    _strings[i] = str;
+    _stringCount++;
     return i;
 }
 
 uint8_t USBManager::allocateEndpoint() {
     uint8_t i = _epCount;
     _epCount++;
+    if (i < 16) {
+        _inOwner[i] = _currentDevice;
+        _outOwner[i] = _currentDevice;
+    }
     return i;
 }
 
-void USBManager::begin() {
-    _wantedAddress = 0;
+// Add an interrupt or isochronous endpoint that moves up to three packets
+// each high speed microframe. The USB 2.0 spec only allows a second packet
+// if the first is bigger than 512 bytes, and a third if it is bigger than
+// 682, so that extra transactions are only used when needed.
+bool USBManager::addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b) {
+    if ((type != EP_INT) && (type != EP_ISO)) return false;
+    if ((transactions < 1) || (transactions > 3)) return false;
+    if (transactions > 1) {
+        if (!_driver->isHighSpeed()) return false;
+        if ((size > 1024) || (size < ((transactions == 2) ? 513 : 683))) return false;
+    }
+
+    uint32_t limit = _driver->isHighSpeed() ? USB_HS_PERIODIC_BYTES : USB_FS_PERIODIC_BYTES;
+    if (_periodicBytes + size * transactions > limit) return false;
+
+    if (!_driver->addPeriodicEndpoint(id, direction, type, size, transactions, a, b)) return false;
+
+    _periodicBytes += size * transactions;
+    if ((direction == EP_IN) && (id < 16)) {
+        _outSize[id] = size * transactions;
+    }
+#ifdef USB_TRACE
+    if (id < 16) {
+        _epType[id] = type;
+    }
+#endif
+    return true;
+}
+
+// Have every device add its endpoints, for the speed the driver is running
+// at, and describe them.
+void USBManager::configureDevices() {
+    _periodicBytes = 0;
     for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
         scan->device->configureEndpoints();
     }
+    buildConfigurationDescriptor();
+    _builtHighSpeed = _driver->isHighSpeed();
+}
+
+void USBManager::begin() {
+    _wantedAddress = 0;
+    configureDevices();
+    buildStringDescriptors();
     _driver->enableUSB();
 }
 
-void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+// Send one of the manager's cached descriptors on EP0. They never change, so
+// they can go out asynchronously straight from the cache without a copy.
+void USBManager::sendControl(const uint8_t *data, uint32_t len) {
+    if (!_driver->submitIn(0, data, len, NULL, NULL)) {
+        _driver->sendBuffer(0, data, len);
+    }
+}
+
+// Encode every string descriptor (language list, manufacturer, product,
+// serial and any device strings) into UTF-16LE once, so that requests
+// for them are answered with a slice of the table.
+void USBManager::buildStringDescriptors() {
+    _strings[1] = _manufacturer;
+    _strings[2] = _product;
+    _strings[3] = _serial;
+
+    uint32_t len = sizeof(struct StringDescriptorHeader);
+    for (int i = 1; i < _stringCount; i++) {
+        uint32_t slen = _strings[i] ? min(strlen(_strings[i]), 126) : 0;
+        len += slen * 2 + 2;
+    }
+
+    if (_stringTable != NULL) {
+        free(_stringTable);
+    }
+    _stringTable = (uint8_t *)malloc(len);
+    if (!_stringTable) {
+        return;
+    }
+
+    uint8_t *ptr = _stringTable;
+    struct StringDescriptorHeader *header = (struct StringDescriptorHeader *)ptr;
+    header->bLength = sizeof(struct StringDescriptorHeader);
+    header->bDescriptorType = 0x03;
+    header->wLANGID = 0x0409;
+    _stringOffset[0] = 0;
+    ptr += sizeof(struct StringDescriptorHeader);
+
+    for (int i = 1; i < _stringCount; i++) {
+        uint32_t slen = _strings[i] ? min(strlen(_strings[i]), 126) : 0;
+        _stringOffset[i] = ptr - _stringTable;
+        *ptr++ = slen * 2 + 2;
+        *ptr++ = 0x03;
+        for (uint32_t j = 0; j < slen; j++) {
+            *ptr++ = _strings[i][j];
+            *ptr++ = 0;
+        }
+    }
+}
+
+// The configuration descriptor doesn't change once the devices have been
+// added, so it is assembled once here and every GET_DESCRIPTOR request
+// is answered straight out of this buffer. A device that can run at high
+// speed also keeps the configuration it would have at the other speed.
+void USBManager::buildConfigurationDescriptor() {
+    _configDescriptorLength = buildConfiguration(&_configDescriptor, _configDescriptorLength, 0x02);
+
+    if (_driver->isHighSpeedCapable()) {
+        _otherSpeed = true;
+        _otherSpeedDescriptorLength = buildConfiguration(&_otherSpeedDescriptor, _otherSpeedDescriptorLength, 0x07);
+        _otherSpeed = false;
+    }
+}
+
+// Assemble a configuration (type 2) or other speed configuration (type 7)
+// descriptor, reusing *buffer if it is already the right size. Returns the
+// length, or 0 if there was no memory for it.
+uint32_t USBManager::buildConfiguration(uint8_t **buffer, uint32_t oldLength, uint8_t type) {
+    uint32_t len = sizeof(struct ConfigurationDescriptor);
+    uint8_t faces = 0;
+
+    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
+        len += scan->device->getDescriptorLength();
+        faces += scan->device->getInterfaceCount();
+    }
+
+    if ((*buffer != NULL) && (oldLength != len)) {
+        free(*buffer);
+        *buffer = NULL;
+    }
+
+    if (*buffer == NULL) {
+        *buffer = (uint8_t *)malloc(len);
+    }
+
+    if (!*buffer) {
+        return 0;
+    }
+
+    uint8_t *ptr = *buffer;
+    struct ConfigurationDescriptor *desc = (struct ConfigurationDescriptor *)*buffer;
+
+    desc->bLength = sizeof(struct ConfigurationDescriptor);
+    desc->bDescriptorType = type;
+    desc->wTotalLength = len;
+    desc->bNumInterfaces = faces;
+    desc->bConfigurationValue = 1;
+    desc->iConfiguration = 0;
+    desc->bmAttributes = 0x80;
+    desc->bMaxPower = 250;
+
+    ptr += sizeof(struct ConfigurationDescriptor);
+
+    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
+        ptr += scan->device->populateConfigurationDescriptor(ptr);
+    }
+
+    return len;
+}
+
+void USBManager::handleSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
     uint16_t signature = (data[0] << 8) | data[1];
     uint16_t outLength = (data[7] << 8) | data[6];
 
     _target = (data[5] << 8) | data[4];
+    _controlOwner = NULL;
+
+    // A host-to-device request with a data stage is only handed over once
+    // the whole data stage has arrived (see finishControlOut()).
+    if (((data[0] & 0x80) == 0) && (outLength > 0)) {
+        memcpy(_controlSetup, data, 8);
+        _controlLength = outLength;
+        _controlReceived = 0;
+        _controlState = USB_CTL_DATA_OUT;
+        switch (data[0] & 0x1F) {
+            case 0x01: // Interface
+            case 0x02: // Endpoint
+                _controlOwner = getRequestOwner(data);
+                break;
+        }
+        return;
+    }
+
+    _controlState = (data[0] & 0x80) ? USB_CTL_DATA_IN : USB_CTL_STATUS;
 
     switch (signature) {
         case 0x8006: // Get Descriptor
@@ -146,7 +634,7 @@ void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
                         struct DeviceDescriptor o;
                         o.bLength = sizeof(struct DeviceDescriptor);
                         o.bDescriptorType = 0x01;
-                        o.bcdUSB = 0x0101;
+                        o.bcdUSB = 0x0200;
                         o.bDeviceClass = 0xEF; //0x00;
                         o.bDeviceSubClass = 0x02; //0x00;
                         o.bDeviceProtocol = 0x01; //0x00;
@@ -162,104 +650,55 @@ void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
                     }
                     break;
 
-                case 2: { // Configuration Descriptor
-                        uint32_t len = sizeof(struct ConfigurationDescriptor);
-                        uint8_t faces = 0;
-
-                        for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-                            len += scan->device->getDescriptorLength();
-                            faces += scan->device->getInterfaceCount();
-                        }
+                case 2: // Configuration Descriptor
+                    if (_configDescriptor == NULL) {
+                        _driver->sendBuffer(0, NULL, 0);
+                        break;
+                    }
+                    sendControl(_configDescriptor, min(outLength, _configDescriptorLength));
+                    break;
 
-                        uint8_t *buf = (uint8_t *)alloca(len);
-                        if (!buf) {
+                case 6: { // Device Qualifier: what would change at the other speed
+                        if (!_driver->isHighSpeedCapable()) {
+                            stallControl();
                             break;
                         }
-                        uint8_t *ptr = buf;
-                        struct ConfigurationDescriptor *desc = (struct ConfigurationDescriptor *)buf;
-
-                        desc->bLength = sizeof(struct ConfigurationDescriptor);
-                        desc->bDescriptorType = 0x02;
-                        desc->wTotalLength = len;
-                        desc->bNumInterfaces = faces;
-                        desc->bConfigurationValue = 1;
-                        desc->iConfiguration = 0;
-                        desc->bmAttributes = 0x80;
-                        desc->bMaxPower = 250;
-
-                        ptr += sizeof(struct ConfigurationDescriptor);
-
-                        for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-                            ptr += scan->device->populateConfigurationDescriptor(ptr);
-                        }
-                        _driver->sendBuffer(0, buf, min(outLength, len));
-//                        free(buf);
+                        struct DeviceQualifierDescriptor q;
+                        q.bLength = sizeof(struct DeviceQualifierDescriptor);
+                        q.bDescriptorType = 0x06;
+                        q.bcdUSB = 0x0200;
+                        q.bDeviceClass = 0xEF;
+                        q.bDeviceSubClass = 0x02;
+                        q.bDeviceProtocol = 0x01;
+                        q.bMaxPacketSize0 = 0x40;
+                        q.bNumConfigurations = 0x01;
+                        q.bReserved = 0;
+                        _driver->sendBuffer(0, (const uint8_t *)&q, min(outLength, sizeof(struct DeviceQualifierDescriptor)));
                     }
                     break;
 
-                case 3: { // String Descriptor
-                        switch (data[2]) {
-                            case 0x00: { // Header
-                                    struct StringDescriptorHeader o;
-                                    o.bLength = sizeof(struct StringDescriptorHeader);
-                                    o.bDescriptorType = 0x03;
-                                    o.wLANGID = 0x0409;
-                                    _driver->sendBuffer(0, (const uint8_t *)&o, min(outLength, sizeof(struct StringDescriptorHeader)));
-                                }
-                                break;
-
-                            case 0x01: { // Manufacturer
-                                    uint8_t mlen = strlen(_manufacturer);
-                                    uint8_t o[mlen * 2 + 2];
-                                    o[0] = mlen * 2 + 2;
-                                    o[1] = 0x03;
-                                    for (int i = 0; i < mlen; i++) {
-                                        o[2 + (i * 2)] = _manufacturer[i];
-                                        o[3 + (i * 2)] = 0;
-                                    }
-                                    _driver->sendBuffer(0, (const uint8_t *)&o, min(outLength, mlen * 2 + 2));
-                                }
-                                break;
-
-                            case 0x02: { // Product
-                                    uint8_t mlen = strlen(_product);
-                                    uint8_t o[mlen * 2 + 2];
-                                    o[0] = mlen * 2 + 2;
-                                    o[1] = 0x03;
-                                    for (int i = 0; i < mlen; i++) {
-                                        o[2 + (i * 2)] = _product[i];
-                                        o[3 + (i * 2)] = 0;
-                                    }
-                                    _driver->sendBuffer(0, (const uint8_t *)&o, min(outLength, mlen * 2 + 2));
-                                }
-                                break;
-
-                            case 0x03: { // Serial
-                                    uint8_t mlen = strlen(_serial);
-                                    uint8_t o[mlen * 2 + 2];
-                                    o[0] = mlen * 2 + 2;
-                                    o[1] = 0x03;
-                                    for (int i = 0; i < mlen; i++) {
-                                        o[2 + (i * 2)] = _serial[i];
-                                        o[3 + (i * 2)] = 0;
-                                    }
-                                    _driver->sendBuffer(0, (const uint8_t *)&o, min(outLength, mlen * 2 + 2));
-                                }
-                                break;
-
-                            default:
-                                for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-                                    if (scan->device->getStringDescriptor(data[2], outLength)) {
-                                        return;
-                                    }
-                                }
-                                
-                                _driver->sendBuffer(0, NULL, 0);
-                                break;
-                        }
+                case 7: // Other Speed Configuration
+                    if (_otherSpeedDescriptor == NULL) {
+                        stallControl();
+                        break;
+                    }
+                    sendControl(_otherSpeedDescriptor, min(outLength, _otherSpeedDescriptorLength));
+                    break;
 
+                case 3: // String Descriptor
+                    if ((_stringTable != NULL) && (data[2] < _stringCount)) {
+                        uint8_t *str = &_stringTable[_stringOffset[data[2]]];
+                        sendControl(str, min(outLength, str[0]));
                         break;
                     }
+
+                    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
+                        if (scan->device->getStringDescriptor(data[2], outLength)) {
+                            return;
+                        }
+                    }
+
+                    stallControl();
                     break;
 
                 default:
@@ -268,17 +707,16 @@ void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
                             return;
                         }
                     }
-                    _driver->sendBuffer(0, NULL, 0);
+                    stallControl();
                     break;
             }
 
             break;
 
         case 0x8106: // Get report descriptor
-            for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-                if (scan->device->getReportDescriptor(ep, _target, data[2], outLength)) {
-                    return;
-                }
+            _controlOwner = getRequestOwner(data);
+            if (_controlOwner && _controlOwner->getReportDescriptor(ep, _target, data[2], outLength)) {
+                return;
             }
             _driver->sendBuffer(0, NULL, 0);
             break;
@@ -288,44 +726,259 @@ void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
             _wantedAddress = data[2];
             break;
 
-        default:
-            for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-                if (scan->device->onSetupPacket(ep, _target, data, l)) {
-                    return;
+        case 0x8000: // Get Status (device)
+        case 0x8100: // Get Status (interface)
+        case 0x8200: { // Get Status (endpoint)
+                uint8_t status[2] = { 0, 0 };
+                if ((data[0] & 0x1F) == 0x01) {
+                    if ((_configuration == 0) || (data[4] >= _ifCount)) {
+                        stallControl();
+                        break;
+                    }
+                } else if ((data[0] & 0x1F) == 0x02) {
+                    if (!endpointExists(data[4])) {
+                        stallControl();
+                        break;
+                    }
+                    status[0] = isHalted(data[4]) ? 1 : 0;
+                }
+                _driver->sendBuffer(0, status, min(outLength, 2));
+            }
+            break;
+
+        case 0x0201: // Clear Feature (endpoint)
+        case 0x0203: // Set Feature (endpoint)
+            if ((data[2] != 0) || !endpointExists(data[4])) { // Only ENDPOINT_HALT
+                stallControl();
+                break;
+            }
+            if ((data[4] & 0x0F) != 0) {
+                uint32_t bit = 1UL << ((data[4] & 0x0F) + ((data[4] & 0x80) ? 16 : 0));
+                if (data[1] == 0x03) {
+#ifdef USB_STATISTICS
+                    _stats.ep[data[4] & 0x0F].stalls++;
+#endif
+                    traceEvent(USB_TRACE_STALL, data[4], NULL, 0);
+                    _halted |= bit;
+                    _driver->stallEndpoint(data[4]);
+                } else {
+                    // Clearing a halt always resets the data toggle, even
+                    // if the endpoint wasn't halted.
+                    _halted &= ~bit;
+                    _driver->clearStall(data[4]);
+                }
+            }
+            _driver->sendBuffer(0, NULL, 0);
+            break;
+
+        case 0x8008: // Get Configuration
+            _driver->sendBuffer(0, &_configuration, min(outLength, 1));
+            break;
+
+        case 0x0009: // Set Configuration
+            if (data[2] > 1) {
+                stallControl();
+                break;
+            }
+            _configuration = data[2];
+            _halted = 0;
+            memset(_altSetting, 0, sizeof(_altSetting));
+            for (int i = 1; i < 16; i++) {
+                if (_outOwner[i]) _driver->clearStall(i);
+                if (_inOwner[i]) _driver->clearStall(i | 0x80);
+            }
+            _driver->sendBuffer(0, NULL, 0);
+            break;
+
+        case 0x810A: // Get Interface
+            if ((_configuration == 0) || (data[4] >= _ifCount) || (data[4] >= USB_MAX_INTERFACES)) {
+                stallControl();
+                break;
+            }
+            _driver->sendBuffer(0, &_altSetting[data[4]], min(outLength, 1));
+            break;
+
+        case 0x010B: // Set Interface
+            if ((_configuration == 0) || (data[4] >= USB_MAX_INTERFACES) || (_ifOwner[data[4]] == NULL)) {
+                stallControl();
+                break;
+            }
+            if (!_ifOwner[data[4]]->setInterface(data[4], data[2])) {
+                stallControl();
+                break;
+            }
+            _altSetting[data[4]] = data[2];
+            // The device's endpoints start again from DATA0
+            for (int i = 1; i < 16; i++) {
+                if (_outOwner[i] == _ifOwner[data[4]]) {
+                    _halted &= ~(1UL << i);
+                    _driver->clearStall(i);
+                }
+                if (_inOwner[i] == _ifOwner[data[4]]) {
+                    _halted &= ~(1UL << (i + 16));
+                    _driver->clearStall(i | 0x80);
                 }
             }
             _driver->sendBuffer(0, NULL, 0);
             break;
+
+        case 0x0001: // Clear Feature (device)
+        case 0x0003: // Set Feature (device)
+        case 0x0101: // Clear Feature (interface)
+        case 0x0103: // Set Feature (interface)
+            // Remote wakeup isn't offered and interfaces have no features
+            stallControl();
+            break;
+
+        default:
+            switch (data[0] & 0x1F) {
+                case 0x01: // Interface
+                case 0x02: // Endpoint
+                    _controlOwner = getRequestOwner(data);
+                    if (_controlOwner && _controlOwner->onSetupPacket(ep, _target, data, l)) {
+                        return;
+                    }
+                    break;
+
+                default:
+                    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
+                        if (scan->device->onSetupPacket(ep, _target, data, l)) {
+                            return;
+                        }
+                    }
+                    break;
+            }
+            _driver->sendBuffer(0, NULL, 0);
+            break;
     }
 }
 
-void USBManager::onInPacket(uint8_t ep, uint8_t *data, uint32_t l) {
-    if (_wantedAddress != 0) {
-        _driver->setAddress(_wantedAddress);
-        _wantedAddress = 0;
-    }
-    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-        if (scan->device->onInPacket(ep, _target, data, l)) {
+void USBManager::handleInPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+    if (ep == 0) {
+        // The IN status stage has gone
+        if (_controlState == USB_CTL_STATUS) {
+            _controlState = USB_CTL_IDLE;
+        }
+        if (_controlOwner) {
+            _controlOwner->onInPacket(ep, _target, data, l);
             return;
         }
+        for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
+            if (scan->device->onInPacket(ep, _target, data, l)) {
+                return;
+            }
+        }
+        return;
+    }
+
+    USBDevice *owner = _inOwner[ep & 0x0F];
+    if (owner) {
+        owner->onInPacket(ep, _target, data, l);
     }
 }
 
-void USBManager::onOutPacket(uint8_t ep, uint8_t *data, uint32_t l) {
-    for (struct USBDeviceList *scan = _devices; scan; scan = scan->next) {
-        if (scan->device->onOutPacket(ep, _target, data, l)) {
+void USBManager::handleOutPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+    if (ep == 0) {
+        if (_controlState == USB_CTL_DATA_OUT) {
+            if (_controlReceived < USB_CONTROL_BUFFER_SIZE) {
+                uint32_t toCopy = min(l, (uint32_t)(USB_CONTROL_BUFFER_SIZE - _controlReceived));
+                memcpy(_controlBuffer + _controlReceived, data, toCopy);
+            }
+            _controlReceived += l;
+            // All the data, or a short packet, ends the data stage
+            if ((_controlReceived >= _controlLength) || (l < 64)) {
+                finishControlOut();
+            }
             return;
         }
+
+        // Anything else is the OUT status stage of an IN request
+        _controlState = USB_CTL_IDLE;
+        return;
+    }
+
+    struct outTransfer *xfer = &_outTransfers[ep & 0x0F];
+    if (xfer->buffer != NULL) {
+        uint32_t toCopy = min(l, xfer->length - xfer->received);
+        memcpy(xfer->buffer + xfer->received, data, toCopy);
+        xfer->received += toCopy;
+        // A full buffer or a short packet ends the transfer
+        if ((xfer->received >= xfer->length) || (l < _outSize[ep & 0x0F])) {
+            USBTransferCallback cb = xfer->callback;
+            xfer->buffer = NULL;
+            if (cb) {
+                cb(ep, xfer->received, xfer->context);
+            }
+        }
+        return;
+    }
+
+    USBDevice *owner = _outOwner[ep & 0x0F];
+    if (owner) {
+        owner->onOutPacket(ep, _target, data, l);
+    }
+}
+
+// The whole OUT data stage of a control request has arrived: hand it to the
+// device it was addressed to, or to every device in turn for other
+// recipients, and send the status stage.
+void USBManager::finishControlOut() {
+    uint32_t len = min(_controlReceived, _controlLength);
+    bool handled = false;
+
+    if (len <= USB_CONTROL_BUFFER_SIZE) {
+        if (_controlOwner) {
+            handled = _controlOwner->onControlOut(_target, _controlSetup, _controlBuffer, len);
+        } else {
+            for (struct USBDeviceList *scan = _devices; scan && !handled; scan = scan->next) {
+                handled = scan->device->onControlOut(_target, _controlSetup, _controlBuffer, len);
+            }
+        }
     }
+
+    // A request nobody took, or whose data didn't all fit, fails in the
+    // status stage rather than being acknowledged
+    if (!handled) {
+        stallControl();
+        return;
+    }
+
+    _controlState = USB_CTL_STATUS;
+    _driver->sendBuffer(0, NULL, 0);
+}
+
+// Receive up to len bytes from an OUT endpoint into data. While the transfer
+// is pending, packets on that endpoint go into the buffer instead of to the
+// device that owns the endpoint.
+bool USBManager::submitOut(uint8_t ep, uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx) {
+    if ((ep == 0) || (ep > 15) || (data == NULL) || (len == 0)) {
+        return false;
+    }
+
+    struct outTransfer *xfer = &_outTransfers[ep];
+    if (xfer->buffer != NULL) {
+        return false;
+    }
+
+    uint32_t s = disableInterrupts();
+    xfer->length = len;
+    xfer->received = 0;
+    xfer->callback = cb;
+    xfer->context = ctx;
+    xfer->buffer = data;
+    restoreInterrupts(s);
+    return true;
 }
 
 void USBManager::addDevice(USBDevice *d) {
-    struct USBDeviceList *newDevice = (struct USBDeviceList *)malloc(sizeof(struct USBDeviceList));
+    struct USBDeviceList *newDevice = (struct USBDeviceList *)allocateBuffer(sizeof(struct USBDeviceList));
     if (!newDevice) {
         return;
     }
     struct USBDeviceList *scan;
+    _currentDevice = d;
     d->initDevice(this);
+    _currentDevice = NULL;
     newDevice->device = d;
     newDevice->next = NULL;
     if (_devices == NULL) {
@@ -340,3 +993,225 @@ void USBManager::addDevice(USBDevice *d) {
     scan->next = newDevice;
 }
 
+
+/*
+ * Deferred event handling.
+ *
+ * Normally the driver's interrupt handler calls straight through into the
+ * manager and the device classes. With deferred events enabled the
+ * interrupt handler only copies each event into a single-producer /
+ * single-consumer queue and returns; the events are then handled with
+ * interrupts enabled when task() is called, either from loop() or from
+ * a chipKIT task.
+ *
+ * Data the hardware has already ACKed can't be refused, so the queue is
+ * never allowed to fill up with it. Once it is half full an endpoint that
+ * delivers OUT data is halted, so the host is NAKed, and task() resumes it
+ * when the queue has been emptied. The last slot is kept for control
+ * traffic on EP0, and a SETUP that still finds no room is handled on the
+ * spot. Only IN completions on other endpoints are ever dropped, and those
+ * are counted. A new address is put to use from the interrupt, as USB
+ * gives the device only 2ms for it, and a bus reset makes task() skip
+ * whatever was still queued from before.
+ */
+
+void USBManager::onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+    // Note here, in the interrupt, whether OUT data follows on EP0 so the
+    // driver can tell it from the next SETUP packet before the request
+    // itself has been handled.
+    if ((l >= 8) && ((data[0] & 0x80) == 0)) {
+        _controlOutRemaining = (data[7] << 8) | data[6];
+    } else {
+        _controlOutRemaining = 0;
+    }
+
+    traceEvent(USB_TRACE_SETUP, ep, data, l);
+
+    // A data stage too long to gather can never be handled, so refuse it
+    // straight away rather than taking the host's data and dropping it
+    if (_controlOutRemaining > USB_CONTROL_BUFFER_SIZE) {
+        _controlOutRemaining = 0;
+        stallControl();
+        return;
+    }
+
+    uint32_t start = profileStart();
+    if (!_events || !queueEvent(USB_EVENT_SETUP, ep, data, l)) {
+        handleSetupPacket(ep, data, l);
+    }
+    profileEnd(USB_PROF_SETUP, ep, start);
+}
+
+void USBManager::onInPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+    // The status stage of SET_ADDRESS has gone, and the new address has to
+    // be in use within 2ms, so it can't wait for task()
+    if (_wantedAddress != 0) {
+        _driver->setAddress(_wantedAddress);
+        _address = _wantedAddress;
+        _wantedAddress = 0;
+    }
+
+    uint32_t start = profileStart();
+    if (_events) {
+        queueEvent(USB_EVENT_IN, ep, NULL, l);
+    } else {
+        handleInPacket(ep, data, l);
+    }
+    profileEnd(USB_PROF_IN, ep, start);
+}
+
+void USBManager::onOutPacket(uint8_t ep, uint8_t *data, uint32_t l) {
+    if ((ep == 0) && (_controlOutRemaining > 0)) {
+        if ((l < 64) || (l >= _controlOutRemaining)) {
+            _controlOutRemaining = 0;
+        } else {
+            _controlOutRemaining -= l;
+        }
+    }
+
+    traceEvent(USB_TRACE_OUT, ep, data, l);
+
+    uint32_t start = profileStart();
+    if (_events) {
+        queueEvent(USB_EVENT_OUT, ep, data, l);
+    } else {
+        handleOutPacket(ep, data, l);
+    }
+    profileEnd(USB_PROF_OUT, ep, start);
+}
+
+// Producer side - only ever called from the interrupt handler.
+bool USBManager::queueEvent(uint8_t type, uint8_t ep, uint8_t *data, uint32_t l) {
+    uint32_t head = _eventHead;
+    uint32_t next = (head + 1) & (USB_EVENT_QUEUE_SIZE - 1);
+    uint32_t space = USB_EVENT_QUEUE_SIZE - 1 - ((head - _eventTail) & (USB_EVENT_QUEUE_SIZE - 1));
+    // Everything on EP0, SETUP included, is control traffic
+    bool control = (type == USB_EVENT_SPEED) || (ep == 0);
+
+    if ((space == 0) || ((space == 1) && !control)) {
+        if ((type != USB_EVENT_SETUP) && (type != USB_EVENT_SPEED)) {
+            _eventOverflows++;
+        }
+        return false;
+    }
+
+    struct USBEvent *ev = &_events[head];
+    ev->type = type;
+    ev->ep = ep;
+    ev->length = l;
+    ev->buffer = ev->data;
+
+    // A packet bigger than a slot (a high speed interrupt or isochronous
+    // endpoint) is left where the driver put it. The endpoint is halted
+    // below, so nothing overwrites it before task() has handled it.
+    bool inPlace = (data != NULL) && (l > USB_EVENT_DATA_SIZE);
+    if (inPlace) {
+        ev->buffer = data;
+    } else if (data != NULL) {
+        memcpy(ev->data, data, l);
+    }
+    _eventHead = next;
+
+    // Hold off any more OUT data on this endpoint until task() catches up
+    if ((type == USB_EVENT_OUT) && (ep != 0) && (inPlace || (space <= USB_EVENT_QUEUE_SIZE / 2))) {
+        _eventHeld |= (1 << ep);
+        _driver->haltEndpoint(ep);
+    }
+    return true;
+}
+
+// Consumer side - process everything queued so far.
+void USBManager::task() {
+    if (!_events) {
+        return;
+    }
+
+    while (_eventTail != _eventHead) {
+        if (_eventFlush) {
+            uint32_t s = disableInterrupts();
+            _eventTail = _eventStale;
+            _eventFlush = false;
+            restoreInterrupts(s);
+            continue;
+        }
+        struct USBEvent *ev = &_events[_eventTail];
+        switch (ev->type) {
+            case USB_EVENT_SETUP:
+                handleSetupPacket(ev->ep, ev->buffer, ev->length);
+                break;
+            case USB_EVENT_IN:
+                handleInPacket(ev->ep, ev->buffer, ev->length);
+                break;
+            case USB_EVENT_OUT:
+                handleOutPacket(ev->ep, ev->buffer, ev->length);
+                break;
+            case USB_EVENT_SPEED:
+                reconfigureSpeed();
+                break;
+        }
+        _eventTail = (_eventTail + 1) & (USB_EVENT_QUEUE_SIZE - 1);
+    }
+
+    // The queue is empty again, so let the host carry on. Endpoints a
+    // device class has halted itself stay halted.
+    if (_eventHeld) {
+        uint32_t s = disableInterrupts();
+        uint16_t held = _eventHeld & ~_classHeld;
+        _eventHeld = 0;
+        restoreInterrupts(s);
+        for (uint8_t ep = 1; ep < 16; ep++) {
+            if (held & (1 << ep)) {
+                _driver->resumeEndpoint(ep);
+            }
+        }
+    }
+}
+
+void USBManager::eventTask(int __attribute__((unused)) id, void *tptr) {
+    USBManager *mgr = (USBManager *)tptr;
+    mgr->task();
+}
+
+// Switch between handling events inside the interrupt (the default) and
+// queueing them for task(). If useTask is set a chipKIT task is created to
+// call task() automatically.
+bool USBManager::setDeferredEvents(bool enable, bool useTask) {
+    if (enable) {
+        if (_events == NULL) {
+            struct USBEvent *events = (struct USBEvent *)malloc(sizeof(struct USBEvent) * USB_EVENT_QUEUE_SIZE);
+            if (!events) {
+                return false;
+            }
+            _eventHead = 0;
+            _eventTail = 0;
+            _eventFlush = false;
+            _events = events;
+        }
+        if (useTask && (_eventTask < 0)) {
+            _eventTask = createTask(eventTask, 0, TASK_ENABLE, this);
+        }
+        return true;
+    }
+
+    if (_eventTask >= 0) {
+        destroyTask(_eventTask);
+        _eventTask = -1;
+    }
+
+    // Drain the queue, then switch back to direct handling at a point
+    // where the interrupt handler can't have queued anything new.
+    struct USBEvent *events = NULL;
+    while (_events != NULL) {
+        task();
+        uint32_t s = disableInterrupts();
+        if (_eventTail == _eventHead) {
+            events = _events;
+            _events = NULL;
+        }
+        restoreInterrupts(s);
+    }
+    if (events != NULL) {
+        free(events);
+    }
+    return true;
+}
@@ -39,21 +39,109 @@
 
 #define USB_TX_TIMEOUT 75
 
+// Packets at least this big are sent straight from the caller's buffer
+// rather than being copied into the endpoint buffer first (USBFS only).
+#ifndef USB_DIRECT_MIN
+#define USB_DIRECT_MIN 8
+#endif
+
+// Packets at least this big are moved between memory and the endpoint FIFO
+// by the USB DMA controller on bulk and large interrupt endpoints (USBHS
+// only). Define USB_NO_DMA to have the CPU move everything.
+#ifndef USB_DMA_MIN
+#define USB_DMA_MIN 64
+#endif
+
+// How many transfers can be waiting on each endpoint at once
+#ifndef USB_TX_QUEUE_DEPTH
+#define USB_TX_QUEUE_DEPTH 4
+#endif
+
+// Largest host-to-device control data stage (SET_REPORT, vendor writes)
+#ifndef USB_CONTROL_BUFFER_SIZE
+#define USB_CONTROL_BUFFER_SIZE 256
+#endif
+
+// Control transfer stages on EP0
+#define USB_CTL_IDLE 0
+#define USB_CTL_DATA_IN 1
+#define USB_CTL_DATA_OUT 2
+#define USB_CTL_STATUS 3
+
+#define USB_MAX_INTERFACES 16
+
+// Periodic (interrupt and isochronous) endpoints may take no more than 90%
+// of a full speed frame or 80% of a high speed microframe.
+#define USB_FS_PERIODIC_BYTES 1350
+#define USB_HS_PERIODIC_BYTES 6000
+#define USB_MAX_STRINGS 16
+
+// Deferred event queue. The size must be a power of two.
+#ifndef USB_EVENT_QUEUE_SIZE
+#define USB_EVENT_QUEUE_SIZE 16
+#endif
+
+#if defined(__PIC32MX__)
+#define USB_EVENT_DATA_SIZE 64
+#else
+#define USB_EVENT_DATA_SIZE 512
+#endif
+
+#define USB_EVENT_SETUP 0
+#define USB_EVENT_IN 1
+#define USB_EVENT_OUT 2
+#define USB_EVENT_SPEED 3       // Bus reset at a new speed: rebuild the endpoints and descriptors
+
+struct USBEvent {
+    uint8_t type;
+    uint8_t ep;
+    uint16_t length;
+    uint8_t *buffer;        // data[], or the driver's own buffer for a packet too big to copy
+    uint8_t data[USB_EVENT_DATA_SIZE];
+};
+
 struct bdt
 {
         uint32_t flags;
         uint8_t *buffer;
 } __attribute__((packed));  // 512 byte aligned in buffer
 
+// Called when an asynchronous transfer completes. len is the number of
+// bytes actually transferred, or USB_TRANSFER_ABORTED if the transfer was
+// thrown away by a bus reset or, on EP0, a new SETUP packet.
+typedef void (*USBTransferCallback)(uint8_t ep, uint32_t len, void *ctx);
+
+#define USB_TRANSFER_ABORTED 0xFFFFFFFFUL
+
+// A transfer waiting in, or being sent from, an endpoint's transmit queue.
+struct usbTransfer {
+    uint8_t *buffer;
+    uint32_t length;
+    USBTransferCallback callback;
+    void *context;
+    bool copied;                    // buffer is a pool block to release when done
+    uint8_t slot;                   // BDT entry holding the last packet (USBFS)
+};
+
 struct epBuffer {
 	uint8_t *rx[2];
 	uint8_t *tx[2];
 	uint8_t data;
 	uint8_t txAB;
     uint32_t size;
-    uint32_t length;
+    struct usbTransfer queue[USB_TX_QUEUE_DEPTH];
+    uint8_t head;                   // oldest unfinished transfer
+    uint8_t count;                  // transfers in the queue
+    uint8_t queued;                 // transfers from head with every packet handed to the hardware
+    uint32_t sent;                  // bytes of the next transfer handed to the hardware so far
+};
+
+struct outTransfer {
     uint8_t *buffer;
-    uint8_t *bufferPtr;
+    uint32_t length;
+    uint32_t received;
+    USBTransferCallback callback;
+    void *context;
 };
 
 struct DeviceDescriptor {
@@ -73,6 +161,18 @@ struct DeviceDescriptor {
     uint8_t     bNumConfigurations;
 } __attribute__((packed));
 
+struct DeviceQualifierDescriptor {
+    uint8_t     bLength;
+    uint8_t     bDescriptorType;
+    uint16_t    bcdUSB;
+    uint8_t     bDeviceClass;
+    uint8_t     bDeviceSubClass;
+    uint8_t     bDeviceProtocol;
+    uint8_t     bMaxPacketSize0;
+    uint8_t     bNumConfigurations;
+    uint8_t     bReserved;
+} __attribute__((packed));
+
 struct ConfigurationDescriptor {
     uint8_t     bLength;
     uint8_t     bDescriptorType;
@@ -113,6 +213,184 @@ struct StringDescriptorHeader {
 class USBManager;
 class USBDevice;
 
+// Fixed block memory pools used for everything the stack allocates at run
+// time. Each pool holds COUNT blocks of SIZE bytes; a request is served from
+// the smallest pool whose blocks are big enough.
+#ifndef USB_POOL_TINY_SIZE
+#define USB_POOL_TINY_SIZE 16
+#endif
+#ifndef USB_POOL_TINY_COUNT
+#define USB_POOL_TINY_COUNT 16
+#endif
+#ifndef USB_POOL_SMALL_SIZE
+#define USB_POOL_SMALL_SIZE 64
+#endif
+#ifndef USB_POOL_LARGE_SIZE
+# if defined(__PIC32MX__)
+#  define USB_POOL_LARGE_SIZE 256
+# else
+#  define USB_POOL_LARGE_SIZE 512
+# endif
+#endif
+#if defined(__PIC32MX__)
+# ifndef USB_POOL_SMALL_COUNT
+#  define USB_POOL_SMALL_COUNT 8
+# endif
+# ifndef USB_POOL_LARGE_COUNT
+#  define USB_POOL_LARGE_COUNT 2
+# endif
+#else
+# ifndef USB_POOL_SMALL_COUNT
+#  define USB_POOL_SMALL_COUNT 16
+# endif
+# ifndef USB_POOL_LARGE_COUNT
+#  define USB_POOL_LARGE_COUNT 8
+# endif
+#endif
+
+#define USB_POOL_TINY 0
+#define USB_POOL_SMALL 1
+#define USB_POOL_LARGE 2
+#define USB_POOLS 3
+
+struct USBPoolStats {
+    uint32_t blockSize;
+    uint32_t blocks;
+    uint32_t inUse;
+    uint32_t highWater;
+    uint32_t failures;      // Requests that should have come from this pool and that no pool could satisfy
+};
+
+// Define USB_STATISTICS in the compiler flags for the whole build (not in a
+// sketch, the library must see it too) to count what the stack does.
+// Without it the counters and the code that updates them compile away.
+//#define USB_STATISTICS
+
+// Bits of U1EIR, in the order of USBStatistics.errors[]
+#define USB_ERR_PID 0
+#define USB_ERR_CRC5 1
+#define USB_ERR_CRC16 2
+#define USB_ERR_DFN8 3
+#define USB_ERR_BTO 4
+#define USB_ERR_DMA 5
+#define USB_ERR_BMX 6
+#define USB_ERR_BTS 7
+
+struct USBEndpointStats {
+    uint32_t inPackets;     // Packets sent to the host
+    uint32_t inBytes;
+    uint32_t outPackets;    // Packets received from the host
+    uint32_t outBytes;
+    uint32_t timeouts;      // sendBuffer gave up after USB_TX_TIMEOUT
+    uint32_t halts;         // haltEndpoint() calls (CDCACM flow control)
+    uint32_t resumes;       // resumeEndpoint() calls
+    uint32_t stalls;        // Protocol stalls sent for the host
+};
+
+struct USBStatistics {
+    struct USBEndpointStats ep[16];
+    uint32_t busResets;
+    uint32_t allocationFailures;
+    uint32_t errors[8];     // Error interrupts by cause (USB_ERR_*; only USB_ERR_DMA on USBHS)
+};
+
+// Define USB_PROFILE in the compiler flags for the whole build to time the
+// interrupt handler and the callbacks it makes with the core timer. Times
+// are in core timer ticks (half the CPU clock).
+//#define USB_PROFILE
+
+#define USB_PROF_ISR 0      // The whole of handleInterrupt()
+#define USB_PROF_RESET 1    // Bus reset handling
+#define USB_PROF_SETUP 2    // SETUP packet callbacks
+#define USB_PROF_IN 3       // IN completion callbacks
+#define USB_PROF_OUT 4      // OUT packet callbacks
+#define USB_PROF_KINDS 5
+
+// Histogram bucket 0 counts times under 64 ticks, bucket n times from
+// 32 << n up to 64 << n, and the last bucket everything longer.
+#define USB_PROFILE_BUCKETS 8
+
+struct USBProfileEntry {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t histogram[USB_PROFILE_BUCKETS];
+};
+
+// Define USB_TRACE in the compiler flags for the whole build to record the
+// last USB_TRACE_SIZE events (a power of two) in a ring that dumpTrace()
+// can write out as a pcap file for Wireshark.
+//#define USB_TRACE
+#ifndef USB_TRACE_SIZE
+#define USB_TRACE_SIZE 64
+#endif
+#define USB_TRACE_DATA 8    // Payload bytes kept with each event
+
+#define USB_TRACE_SETUP 0
+#define USB_TRACE_IN 1      // Packet handed to the hardware for the host
+#define USB_TRACE_OUT 2     // Packet received from the host
+#define USB_TRACE_RESET 3
+#define USB_TRACE_STALL 4
+#define USB_TRACE_TIMEOUT 5
+
+struct USBTraceEvent {
+    uint32_t time;          // micros()
+    uint8_t type;           // USB_TRACE_*
+    uint8_t ep;             // Endpoint address, bit 7 set for IN
+    uint8_t address;        // Device address at the time
+    uint8_t captured;       // Bytes of data[] used
+    uint32_t length;        // Full length of the packet
+    uint8_t data[USB_TRACE_DATA];
+};
+
+class USBPool {
+    private:
+        uint8_t *_storage;
+        uint32_t _blockSize;
+        uint32_t _blocks;
+        void *_free;
+        volatile uint32_t _inUse;
+        volatile uint32_t _highWater;
+        volatile uint32_t _failures;
+
+    public:
+        USBPool() : _storage(NULL), _blockSize(0), _blocks(0), _free(NULL), _inUse(0), _highWater(0), _failures(0) {}
+        void init(uint8_t *storage, uint32_t blockSize, uint32_t blocks);
+        void *allocate();
+        void countFailure();
+        void release(void *block);
+        bool owns(const void *block) {
+            return ((const uint8_t *)block >= _storage) && ((const uint8_t *)block < _storage + (_blockSize * _blocks));
+        }
+        uint32_t getBlockSize() { return _blockSize; }
+        void getStats(struct USBPoolStats *stats);
+};
+
+// Bytes of USBHS endpoint FIFO RAM, EP0's 64 included
+#define USB_FIFO_SIZE 4096
+#define USB_FIFO_TOO_BIG 0xFF
+
+// Where an endpoint's FIFO went, in the form the USBHS registers take it
+struct USBFifoSlot {
+    uint16_t address;       // 8 byte units
+    uint8_t sz;             // Size code: the FIFO holds 2^(sz + 3) bytes
+    bool dpb;               // Double-buffered: two FIFOs of that size
+};
+
+class USBFifoAllocator {
+    private:
+        uint32_t _offset;           // Next free FIFO RAM, in 8 byte units
+        uint32_t _failures;         // Endpoints that didn't fit
+
+    public:
+        USBFifoAllocator() : _offset(8), _failures(0) {}
+        void reset() { _offset = 8; }
+        static uint8_t sizeCode(uint32_t bytes);
+        bool allocate(uint32_t bytes, uint8_t type, struct USBFifoSlot *slot);
+        uint32_t getUsed() { return _offset * 8; }
+        uint32_t getFailures() { return _failures; }
+};
+
 class USBDriver {
 	public:
 		USBDriver() {}
@@ -128,8 +406,32 @@ class USBDriver {
         }
 
         virtual bool isHighSpeed() = 0;
+        virtual bool isHighSpeedCapable() { return isHighSpeed(); }    // True if the hardware can run at high speed, whatever it is running at now
+        virtual void resetEndpoints() {}    // Called before the manager adds all the endpoints again for a new bus speed
         virtual void haltEndpoint(uint8_t ep) = 0;
         virtual void resumeEndpoint(uint8_t ep) = 0;
+        // Protocol stalls requested by the host. ep is an endpoint address
+        // (bit 7 set for IN); stalling EP0 refuses the current control
+        // request. Clearing a stall also resets the endpoint's data toggle.
+        virtual void stallEndpoint(uint8_t ep) { haltEndpoint(ep & 0x0F); }
+        virtual void clearStall(uint8_t ep) { resumeEndpoint(ep & 0x0F); }
+
+        // Start sending a buffer and return immediately. The buffer must stay
+        // valid until the callback is called. Drivers that can't do this
+        // asynchronously fall back to a blocking send.
+        virtual bool submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx) {
+            bool ok = sendBuffer(ep, data, len);
+            if (ok && cb) cb(ep, len, ctx);
+            return ok;
+        }
+
+        // A high-bandwidth periodic endpoint, moving up to `transactions`
+        // packets of `size` bytes each microframe. Drivers that can only do
+        // one per (micro)frame refuse anything more.
+        virtual bool addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b) {
+            if (transactions != 1) return false;
+            return addEndpoint(id, direction, type, size, a, b);
+        }
 
         USBManager *_manager;
 };
@@ -143,6 +445,9 @@ class USBFS : public USBDriver {
 		uint32_t _enabledEndpoints;
 		struct epBuffer _endpointBuffers[16];
 
+        volatile uint16_t _rxHeld;      // Endpoints halted by haltEndpoint()
+        volatile uint32_t _rxParked;    // RX BDT entries not re-armed while halted, two bits per endpoint
+
         uint8_t _ctlRxA[64];
         uint8_t _ctlRxB[64];
         uint8_t _ctlTxA[64];
@@ -150,8 +455,15 @@ class USBFS : public USBDriver {
 
         volatile bool _inIsr;
 
+        void continueTransmit(uint8_t ep);
+        bool queueTransfer(uint8_t ep, const uint8_t *data, uint32_t len, bool copied, USBTransferCallback cb, void *ctx);
+        void abortTransfers(uint8_t ep);
+        bool queuePacket(uint8_t ep, const uint8_t *data, uint32_t len, bool direct);
+        bool isTransmitting(uint8_t ep);
+        bool sendBufferWait(uint8_t ep, const uint8_t *data, uint32_t len);
+
 	public:
-		USBFS() : _enabledEndpoints(0), _inIsr(false) { _this = this; }
+		USBFS() : _enabledEndpoints(0), _rxHeld(0), _rxParked(0), _inIsr(false) { _this = this; }
 		bool enableUSB();
 		bool disableUSB();
 		bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b);
@@ -159,11 +471,14 @@ class USBFS : public USBDriver {
 		bool setAddress(uint8_t address);
         bool canEnqueuePacket(uint8_t ep);
         bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len);
+        bool submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx);
 
         bool isHighSpeed() { return false; }
 
-        void haltEndpoint(uint8_t ep) {}
-        void resumeEndpoint(uint8_t ep) {}
+        void haltEndpoint(uint8_t ep);
+        void resumeEndpoint(uint8_t ep);
+        void stallEndpoint(uint8_t ep);
+        void clearStall(uint8_t ep);
 
 		void handleInterrupt();
 
@@ -176,16 +491,42 @@ class USBFS : public USBDriver {
 
 #ifdef __PIC32MZ__
 class USBFS;
+// The USBHS module has eight DMA channels, given out to endpoints as they
+// are added.
+#define USB_DMA_CHANNELS 8
+
+struct dmaChannel {
+    uint8_t ep;
+    bool tx;
+    uint8_t *buffer;
+    uint32_t length;
+};
+
 class USBHS : public USBDriver {
 	protected:
 		static __USER_ISR void _usbInterrupt() {
 			_this->handleInterrupt();
 		}
+		static __USER_ISR void _usbDmaInterrupt() {
+			_this->handleDmaInterrupt();
+		}
 		static USBHS *_this;
-        uint32_t _fifoOffset;
+        USBFifoAllocator _fifo;
 		uint32_t _enabledEndpoints;
 		struct epBuffer _endpointBuffers[16];
 
+        struct dmaChannel _dma[USB_DMA_CHANNELS];
+        uint8_t _dmaChannel[8][2];      // Channel + 1 for each endpoint's RX [0] and TX [1], 0 for none
+        uint8_t _dmaAllocated;          // Channels given out
+        volatile uint8_t _dmaBusy;      // Endpoints with a TX DMA in progress
+        volatile uint8_t _dmaRxBusy;    // Endpoints whose RX buffer the DMA controller is using
+        volatile uint8_t _rxWaiting;    // Endpoints with a packet left in the FIFO until that is done
+        volatile uint8_t _rxHeld;       // Endpoints halted by haltEndpoint()
+        bool _highSpeed;                // Speed negotiated at the last bus reset
+        bool _autoBulk;                 // Put bulk endpoints in auto mode as they are added
+        uint8_t _autoTx;                // Endpoints using AUTOSET
+        uint8_t _autoRx;                // Endpoints using AUTOCLR
+
         uint8_t _ctlRxA[64];
         uint8_t _ctlRxB[64];
         uint8_t _ctlTxA[64];
@@ -193,22 +534,55 @@ class USBHS : public USBDriver {
 
         volatile bool _inIsr;
 
+        void continueTransmit(uint8_t ep);
+        bool queueTransfer(uint8_t ep, const uint8_t *data, uint32_t len, bool copied, USBTransferCallback cb, void *ctx);
+        void abortTransfers(uint8_t ep);
+        bool queuePacket(uint8_t ep, const uint8_t *data, uint32_t len, bool dma);
+        bool queueBurst(uint8_t ep, const uint8_t *data, uint32_t len);
+        void writePacket(uint8_t ep, const uint8_t *data, uint32_t len);
+        bool sendBufferWait(uint8_t ep, const uint8_t *data, uint32_t len);
+        void receivePacket(uint8_t ep);
+        void transmitComplete(uint8_t ep);
+        bool configureEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b);
+        void enableDma();
+        bool allocateDma(uint8_t ep, uint8_t dir);
+        bool startDma(uint8_t ep, bool tx, uint8_t *buffer, uint32_t len);
+
 	public:
-		USBHS() : _fifoOffset(8), _enabledEndpoints(0), _inIsr(false) { _this = this; }
+		USBHS() : _enabledEndpoints(0), _dmaAllocated(0), _dmaBusy(0), _dmaRxBusy(0), _rxWaiting(0), _rxHeld(0), _highSpeed(true), _autoBulk(false), _autoTx(0), _autoRx(0), _inIsr(false) {
+            _this = this;
+            memset(_dmaChannel, 0, sizeof(_dmaChannel));
+        }
 		virtual bool enableUSB();
-        virtual bool isHighSpeed() { return true; }
+        virtual bool isHighSpeed() { return _highSpeed; }
+        virtual bool isHighSpeedCapable() { return true; }
+        void resetEndpoints();
 		bool disableUSB();
 		bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b);
+        bool addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b);
 		bool enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len);
 		bool setAddress(uint8_t address);
         bool canEnqueuePacket(uint8_t ep);
         bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len);
-
+        bool submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx);
 
 		void handleInterrupt();
+		void handleDmaInterrupt();
+
+        // Call before USB.begin(). Bulk endpoints with a DMA channel then
+        // move whole transfers with one interrupt.
+        void setAutoBulk(bool enable) { _autoBulk = enable; }
+
+        uint32_t getFifoUsed() { return _fifo.getUsed(); }
+        uint32_t getFifoFailures() { return _fifo.getFailures(); }
+
+        static void readFifo(uint8_t ep, uint8_t *data, uint32_t len);
+        static void writeFifo(uint8_t ep, const uint8_t *data, uint32_t len);
 
         void haltEndpoint(uint8_t ep);
         void resumeEndpoint(uint8_t ep);
+        void stallEndpoint(uint8_t ep);
+        void clearStall(uint8_t ep);
 
         using USBDriver::_manager;
 
@@ -220,6 +594,96 @@ class USBFS : public USBHS {
     public:
         bool enableUSB();
         bool isHighSpeed() { return false; }
+        bool isHighSpeedCapable() { return false; }
+};
+#endif
+
+#if !defined(__PIC32MX__) && !defined(__PIC32MZ__)
+// Results from the USBSimDriver host functions that aren't a length
+#define USB_SIM_NAK -1
+#define USB_SIM_STALL -2
+#define USB_SIM_TIMEOUT -3
+
+// Packets each simulated endpoint can hold for the host
+#ifndef USB_SIM_FIFO_PACKETS
+#define USB_SIM_FIFO_PACKETS 16
+#endif
+
+// Largest packet a simulated endpoint takes: three 1024 byte transactions
+// of a high-bandwidth endpoint
+#ifndef USB_SIM_MAX_PACKET
+#define USB_SIM_MAX_PACKET 3072
+#endif
+
+struct simPacket {
+    uint32_t ready;                 // millis() when the host can have it
+    uint32_t length;
+    uint8_t data[USB_SIM_MAX_PACKET];
+};
+
+struct simEndpoint {
+    uint32_t rxSize;                // 0 if the host can't send to it
+    uint32_t txSize;                // 0 if the device can't send from it
+    uint8_t type;
+    uint8_t *rx;
+    struct simPacket fifo[USB_SIM_FIFO_PACKETS];
+    uint32_t head;
+    uint32_t count;
+    uint32_t naks;                  // NAKs to give before anything else
+    uint32_t delay;                 // ms before a queued packet reaches the host
+    bool stallIn;
+    bool stallOut;
+    bool halted;                    // haltEndpoint() flow control: NAK the host's OUT packets
+};
+
+// A driver with no hardware behind it, so the manager and the device
+// classes can be built and exercised on a PC. The program using it plays
+// the host through the host*() functions.
+class USBSimDriver : public USBDriver {
+    private:
+        struct simEndpoint _ep[16];
+        uint8_t _ctlRx[64];
+        uint8_t _ctlTx[64];
+        bool _enabled;
+        bool _highSpeed;
+        uint8_t _address;
+
+        void flush(uint8_t ep);
+        int waitIn(uint8_t ep, uint8_t *data, uint32_t maxlen);
+        int waitOut(uint8_t ep, const uint8_t *data, uint32_t len);
+
+    public:
+        USBSimDriver(bool highSpeed = false);
+        bool enableUSB();
+        bool disableUSB();
+        bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b);
+        bool addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b);
+        bool enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len);
+        bool canEnqueuePacket(uint8_t ep);
+        bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len);
+        bool setAddress(uint8_t address);
+        bool isHighSpeed() { return _highSpeed; }
+        void haltEndpoint(uint8_t ep);
+        void resumeEndpoint(uint8_t ep);
+        void stallEndpoint(uint8_t ep);
+        void clearStall(uint8_t ep);
+
+        // The host side
+        void hostReset();
+        void hostSetup(const uint8_t *setup);
+        int hostOut(uint8_t ep, const uint8_t *data, uint32_t len);
+        int hostIn(uint8_t ep, uint8_t *data, uint32_t maxlen);
+        int controlTransfer(const uint8_t *setup, uint8_t *data, uint32_t maxlen);
+        void setHighSpeed(bool hs) { _highSpeed = hs; }
+
+        // Fault injection
+        void injectNak(uint8_t ep, uint32_t count);
+        void setDelay(uint8_t ep, uint32_t ms);
+
+        bool isEnabled() { return _enabled; }
+        uint8_t getAddress() { return _address; }
+        uint32_t pending(uint8_t ep) { return _ep[ep & 0x0F].count; }
+        bool isStalled(uint8_t ep);
 };
 #endif
 
@@ -240,19 +704,116 @@ class USBManager {
         uint8_t _epCount;
         uint8_t _target;
 
+        uint8_t *_configDescriptor;
+        uint32_t _configDescriptorLength;
+        uint8_t *_otherSpeedDescriptor;     // The configuration at the speed we aren't running at, for high speed capable devices
+        uint32_t _otherSpeedDescriptorLength;
+        bool _otherSpeed;                   // Set while _otherSpeedDescriptor is being built
+        bool _builtHighSpeed;               // Speed the endpoints and descriptors were last set up for
+
+        USBDevice *_currentDevice;  // Device currently running initDevice()
+        USBDevice *_inOwner[16];    // Device that owns each endpoint, for IN completions
+        USBDevice *_outOwner[16];   // Device that owns each endpoint, for OUT packets
+        USBDevice *_ifOwner[USB_MAX_INTERFACES];    // Device that owns each interface number
+        USBDevice *_controlOwner;   // Device that the current control transfer was routed to
+        uint32_t _outSize[16];      // Packet size of each OUT endpoint
+        uint32_t _periodicBytes;    // Bytes per (micro)frame reserved by periodic endpoints
+        struct outTransfer _outTransfers[16];
+
+        USBDevice *getRequestOwner(uint8_t *data);
+
+        uint8_t _controlState;      // Stage of the current control transfer (USB_CTL_*)
+        uint8_t _controlSetup[8];   // SETUP packet of the current control transfer
+        uint8_t _controlBuffer[USB_CONTROL_BUFFER_SIZE];    // OUT data stage gathered so far
+        uint16_t _controlLength;
+        uint16_t _controlReceived;
+        volatile uint16_t _controlOutRemaining; // OUT data stage bytes still to come, tracked in the ISR
+
+        void finishControlOut();
+
+        uint8_t _address;           // Current device address
+        uint8_t _configuration;     // Current configuration value, 0 when unconfigured
+        uint32_t _halted;           // Endpoints halted by the host: bit n for OUT n, bit n+16 for IN n
+        uint8_t _altSetting[USB_MAX_INTERFACES];    // Current alternate setting of each interface
+
+        bool endpointExists(uint8_t ep);
+        bool isHalted(uint8_t ep);
+        void stallControl();
+
         const char *_manufacturer;
         const char *_product;
         const char *_serial;
-        char _defSerial[14];
+        char _defSerial[15];
+
+        const char *_strings[USB_MAX_STRINGS];  // Extra strings registered by devices (index 4 upwards)
+        uint8_t _stringCount;
+        uint8_t *_stringTable;                  // Encoded string descriptors, back to back
+        uint16_t _stringOffset[USB_MAX_STRINGS];
+
+        struct USBEvent *_events;   // Deferred event queue, NULL when events are handled in the ISR
+        volatile uint32_t _eventHead;
+        volatile uint32_t _eventTail;
+        volatile uint32_t _eventOverflows;
+        volatile uint16_t _eventHeld;   // OUT endpoints halted until the queue drains
+        volatile uint32_t _eventStale;  // Queue position at the last bus reset...
+        volatile bool _eventFlush;      // ...which task() is to skip to
+        uint16_t _classHeld;            // Endpoints halted by the device classes
+        int _eventTask;
 
         void populateDefaultSerial();
+        void buildConfigurationDescriptor();
+        void configureDevices();
+        void reconfigureSpeed();
+        uint32_t buildConfiguration(uint8_t **buffer, uint32_t oldLength, uint8_t type);
+        void buildStringDescriptors();
+
+        uint8_t _poolTiny[USB_POOL_TINY_SIZE * USB_POOL_TINY_COUNT] __attribute__((aligned(4)));
+        uint8_t _poolSmall[USB_POOL_SMALL_SIZE * USB_POOL_SMALL_COUNT] __attribute__((aligned(4)));
+        uint8_t _poolLarge[USB_POOL_LARGE_SIZE * USB_POOL_LARGE_COUNT] __attribute__((aligned(4)));
+        USBPool _pools[USB_POOLS];
+        volatile uint32_t _allocationFailures;
+
+#ifdef USB_STATISTICS
+        struct USBStatistics _stats;
+#endif
+
+#ifdef USB_PROFILE
+        struct USBProfileEntry _profile[USB_PROF_KINDS][16];   // ISR and RESET use endpoint 0
+#endif
+
+#ifdef USB_TRACE
+        struct USBTraceEvent _trace[USB_TRACE_SIZE];
+        volatile uint32_t _traceHead;   // Total events recorded; the next one goes in _trace[_traceHead % USB_TRACE_SIZE]
+        uint8_t _epType[16];            // Endpoint types (EP_CTL etc.) for the pcap records
+#endif
+
+        void initPools();
+        void sendControl(const uint8_t *data, uint32_t len);
+
+        bool queueEvent(uint8_t type, uint8_t ep, uint8_t *data, uint32_t l);
+        void handleSetupPacket(uint8_t ep, uint8_t *data, uint32_t l);
+        void handleInPacket(uint8_t ep, uint8_t *data, uint32_t l);
+        void handleOutPacket(uint8_t ep, uint8_t *data, uint32_t l);
+
+        static void eventTask(int id, void *tptr);
 
 	public:
+        // Called by the driver from its interrupt handler
         void onSetupPacket(uint8_t ep, uint8_t *data, uint32_t l);
         void onInPacket(uint8_t ep, uint8_t *data, uint32_t l);
         void onOutPacket(uint8_t ep, uint8_t *data, uint32_t l);
+        bool isControlOutStage() { return _controlOutRemaining > 0; }  // True while EP0 expects OUT data rather than SETUP
+        void onBusReset();
+        uint8_t getConfiguration() { return _configuration; }
+
+        bool setDeferredEvents(bool enable, bool useTask = false);
+        void task();
+        uint32_t getEventOverflows() { return _eventOverflows; }
 
-        bool isHighSpeed() { return _driver->isHighSpeed(); }
+        // While the other speed configuration is being built this gives the
+        // speed the device isn't running at, so the classes describe their
+        // endpoints for that speed.
+        bool isHighSpeed() { return _driver->isHighSpeed() != _otherSpeed; }
 
 		USBManager(USBDriver *driver, uint16_t vid, uint16_t pid, const char *mfg, const char *prod, const char *ser = NULL);
 		USBManager(USBDriver &driver, uint16_t vid, uint16_t pid, const char *mfg, const char *prod, const char *ser = NULL);
@@ -265,25 +826,122 @@ class USBManager {
 
         uint8_t allocateInterface();
         uint8_t allocateEndpoint();
+        uint8_t allocateString(const char *str);
+
+        // Run-time memory for the stack. Safe to call from the interrupt.
+        void *allocateBuffer(uint32_t len);
+        void releaseBuffer(void *buf);
+        bool getPoolStats(uint8_t pool, struct USBPoolStats *stats);
+        uint32_t getAllocationFailures() { return _allocationFailures; }
+
+        // Event tracing. dumpTrace() writes the ring as a pcap file
+        // (LINKTYPE_USB_LINUX_MMAPPED) and returns the number of bytes
+        // written, 0 unless the stack was built with USB_TRACE.
+        size_t dumpTrace(Print &out);
+        size_t dumpTrace(uint8_t *buf, size_t len);
+        void clearTrace();
+
+#ifdef USB_TRACE
+        void traceEvent(uint8_t type, uint8_t ep, const uint8_t *data, uint32_t len);
+#else
+        void traceEvent(uint8_t type, uint8_t ep, const uint8_t *data, uint32_t len) {}
+#endif
+
+        // Interrupt profiling. The drivers call profileStart() on the way in
+        // and profileEnd() on the way out. getProfile() returns false,
+        // with everything zero, unless the stack was built with USB_PROFILE.
+        bool getProfile(uint8_t kind, uint8_t ep, struct USBProfileEntry *entry);
+        void resetProfile();
+
+#ifdef USB_PROFILE
+        static uint32_t profileStart() { return _CP0_GET_COUNT(); }
+        void profileEnd(uint8_t kind, uint8_t ep, uint32_t start);
+#else
+        static uint32_t profileStart() { return 0; }
+        void profileEnd(uint8_t kind, uint8_t ep, uint32_t start) {}
+#endif
+
+        // Statistics. getStatistics() returns false, with everything zero,
+        // unless the stack was built with USB_STATISTICS.
+        bool getStatistics(struct USBStatistics *snapshot);
+        void resetStatistics();
+
+#ifdef USB_STATISTICS
+        void countIn(uint8_t ep, uint32_t len) { _stats.ep[ep & 0x0F].inPackets++; _stats.ep[ep & 0x0F].inBytes += len; }
+        void countOut(uint8_t ep, uint32_t len) { _stats.ep[ep & 0x0F].outPackets++; _stats.ep[ep & 0x0F].outBytes += len; }
+        void countErrors(uint8_t causes) {
+            for (int i = 0; i < 8; i++) {
+                if (causes & (1 << i)) _stats.errors[i]++;
+            }
+        }
+#else
+        void countIn(uint8_t ep, uint32_t len) {}
+        void countOut(uint8_t ep, uint32_t len) {}
+        void countErrors(uint8_t causes) {}
+#endif
+        void countTimeout(uint8_t ep) {
+#ifdef USB_STATISTICS
+            _stats.ep[ep & 0x0F].timeouts++;
+#endif
+            traceEvent(USB_TRACE_TIMEOUT, ep, NULL, 0);
+        }
 
         bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b) {
+            if ((direction == EP_IN) && (id < 16)) {
+                _outSize[id] = size;
+            }
+            if ((type == EP_INT) || (type == EP_ISO)) {
+                _periodicBytes += size;
+            }
+#ifdef USB_TRACE
+            if (id < 16) {
+                _epType[id] = type;
+            }
+#endif
             return _driver->addEndpoint(id, direction, type, size, a, b);
         }
 
+        // High-bandwidth interrupt and isochronous endpoints. Returns false,
+        // and adds nothing, if the bus speed, packet size or periodic
+        // bandwidth left don't allow it. The descriptor's wMaxPacketSize
+        // must then come from maxPacketField().
+        bool addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b);
+        static uint16_t maxPacketField(uint32_t size, uint8_t transactions) { return size | ((transactions - 1) << 11); }
+        uint32_t getPeriodicBandwidth() { return _periodicBytes; }
+
         bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
             return _driver->sendBuffer(ep, data, len);
         }
 
+        // Asynchronous transfers. These return straight away and call cb (if
+        // given) from the interrupt when the transfer has finished. The buffer
+        // must remain valid until then.
+        bool submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb = NULL, void *ctx = NULL) {
+            return _driver->submitIn(ep, data, len, cb, ctx);
+        }
+        bool submitOut(uint8_t ep, uint8_t *data, uint32_t len, USBTransferCallback cb = NULL, void *ctx = NULL);
+
         bool canEnqueuePacket(uint8_t ep) {
             return _driver->canEnqueuePacket(ep);
         }
 
         void haltEndpoint(uint8_t ep) {
+#ifdef USB_STATISTICS
+            _stats.ep[ep & 0x0F].halts++;
+#endif
+            _classHeld |= (1 << (ep & 0x0F));
             _driver->haltEndpoint(ep);
         }
 
         void resumeEndpoint(uint8_t ep) {
-            _driver->resumeEndpoint(ep);
+#ifdef USB_STATISTICS
+            _stats.ep[ep & 0x0F].resumes++;
+#endif
+            _classHeld &= ~(1 << (ep & 0x0F));
+            // task() resumes it once the event queue has drained
+            if (!(_eventHeld & (1 << (ep & 0x0F)))) {
+                _driver->resumeEndpoint(ep);
+            }
         }
 
         void end() {}
@@ -305,6 +963,8 @@ class USBDevice {
         virtual bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) = 0;  // Called when a SETUP packet arrives
         virtual bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) = 0; // Called when an IN packet is requested
         virtual bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) = 0;    // Called when an OUT packet arrives
+        virtual bool onControlOut(uint8_t target, uint8_t *setup, uint8_t *data, uint32_t l) { return false; } // Called with the whole data stage of a host-to-device control request
+        virtual bool setInterface(uint8_t interface, uint8_t alt) { return alt == 0; }    // Called when SET_INTERFACE arrives. Return false if alt isn't supported
 };
 
 class CDCACM : public USBDevice, public Stream {
@@ -314,7 +974,9 @@ class CDCACM : public USBDevice, public Stream {
         uint8_t _ifBulk;
         uint8_t _epControl;
         uint8_t _epBulk;
-        uint8_t _outAction;
+
+        const char *_name;
+        uint8_t _iName;             // String index of _name, 0 if there isn't one
 
         uint8_t _lineState;
         uint32_t _baud;
@@ -330,12 +992,13 @@ class CDCACM : public USBDevice, public Stream {
         uint8_t _bulkTxA[64];
         uint8_t _bulkTxB[64];
 #define CDCACM_BUFFER_HIGH 64
-#elif defined(__PIC32MZ__)
+#else
 //        uint8_t _txBuffer[2048];
 #define CDCACM_BUFFER_SIZE 2048
         uint8_t _rxBuffer[CDCACM_BUFFER_SIZE];
-        uint8_t _bulkRxA[512];
-        uint8_t _bulkRxB[512];
+        // Whole cache lines, so USBHS can DMA straight into them
+        uint8_t _bulkRxA[512] __attribute__((aligned(16)));
+        uint8_t _bulkRxB[512] __attribute__((aligned(16)));
         uint8_t _bulkTxA[512];
         uint8_t _bulkTxB[512];
 #define CDCACM_BUFFER_HIGH 512
@@ -348,7 +1011,7 @@ class CDCACM : public USBDevice, public Stream {
         uint8_t _ctlB[8];
 
     public:
-        CDCACM() : _txPos(0), _rxHead(0), _rxTail(0) {}
+        CDCACM(const char *name = NULL) : _name(name), _iName(0), _txPos(0), _rxHead(0), _rxTail(0) {}
 
         operator int();
         uint16_t getDescriptorLength();
@@ -363,6 +1026,7 @@ class CDCACM : public USBDevice, public Stream {
         bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
         bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
         bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
+        bool onControlOut(uint8_t target, uint8_t *setup, uint8_t *data, uint32_t l);
 
         size_t write(uint8_t);
         size_t write(const uint8_t *b, size_t len);
@@ -595,7 +1259,6 @@ class HID_Raw : public USBDevice {
         uint8_t _intRxB[64];
         uint8_t _intTxA[64];
         uint8_t _intTxB[64];
-        bool _nextPacketIsMine;
         uint8_t _features[256];
 
     public:
@@ -612,6 +1275,7 @@ class HID_Raw : public USBDevice {
         bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
         bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
         bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l);
+        bool onControlOut(uint8_t target, uint8_t *setup, uint8_t *data, uint32_t l);
 
         void begin(void) {};
         void end(void) {};
@@ -632,9 +1296,10 @@ class Audio_MIDI : public USBDevice {
         uint8_t _bulkRxB[64];
         uint8_t _bulkTxA[64];
         uint8_t _bulkTxB[64];
-#elif defined(__PIC32MZ__)
-        uint8_t _bulkRxA[512];
-        uint8_t _bulkRxB[512];
+#else
+        // Whole cache lines, so USBHS can DMA straight into them
+        uint8_t _bulkRxA[512] __attribute__((aligned(16)));
+        uint8_t _bulkRxB[512] __attribute__((aligned(16)));
         uint8_t _bulkTxA[512];
         uint8_t _bulkTxB[512];
 #endif
@@ -30,7 +30,6 @@
 
 #include <USB.h>
 
-#define CDC_ACT_SET_LINE_CODING 1
 
 struct CDCLineCoding {
     uint32_t dwDTERate;
@@ -58,7 +57,7 @@ uint32_t CDCACM::populateConfigurationDescriptor(uint8_t *buf) {
     buf[i++] =     0x02;                                   // bFunctionClass
     buf[i++] =     0x02;                                   // bFunctionSubClass
     buf[i++] =     0x01;                                   // bFunctionProtocol
-    buf[i++] =     0; // iFunction
+    buf[i++] =     _iName;                                 // iFunction
 
 
     buf[i++] = 9;          // length
@@ -69,7 +68,7 @@ uint32_t CDCACM::populateConfigurationDescriptor(uint8_t *buf) {
     buf[i++] = 0x02;       // interface class (comm)
     buf[i++] = 0x02;       // subclass (acm)
     buf[i++] = 0x01;       // protocol (at)
-    buf[i++] = 0;           // iInterface
+    buf[i++] = _iName;     // iInterface
 
     buf[i++] = 5;          // length
     buf[i++] = 0x24;       // header functional descriptor
@@ -147,6 +146,9 @@ void CDCACM::initDevice(USBManager *manager) {
     _ifBulk = _manager->allocateInterface();
     _epControl = _manager->allocateEndpoint();
     _epBulk = _manager->allocateEndpoint();
+    if (_name != NULL) {
+        _iName = _manager->allocateString(_name);
+    }
 }
 
 bool CDCACM::getDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) {
@@ -169,9 +171,6 @@ bool CDCACM::onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l
     if (data[4] == _ifControl) {
         uint16_t signature = (data[0] << 8) | data[1];
         switch (signature) {
-            case 0x2120:
-                _outAction = CDC_ACT_SET_LINE_CODING;
-                return true;
             case 0x2122:
                 _lineState = data[2];
                 if ((_lineState == 0) && (_baud == 1200)) {
@@ -207,25 +206,29 @@ bool CDCACM::onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
     return false;
 }
 
-bool CDCACM::onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
-    if (ep == 0) {
-        if (target == _ifControl) {
-            switch(_outAction) {
-                case CDC_ACT_SET_LINE_CODING:
-                    struct CDCLineCoding *coding = (struct CDCLineCoding *)data;
-                    if ((coding->dwDTERate == 0) && (_baud == 1200)) {
-                        executeSoftReset(ENTER_BOOTLOADER_ON_BOOT);
-                    }
-                    _baud = coding->dwDTERate;
-                    _stopBits = coding->bCharFormat;
-                    _parity = coding->bParityType;
-                    _dataBits = coding->bDataBits;
-                    _manager->sendBuffer(0, NULL, 0);
-                    return true;
+bool CDCACM::onControlOut(uint8_t target, uint8_t *setup, uint8_t *data, uint32_t l) {
+    if (target != _ifControl) return false;
+
+    uint16_t signature = (setup[0] << 8) | setup[1];
+    switch (signature) {
+        case 0x2120: {
+                if (l < 7) return false;
+                struct CDCLineCoding *coding = (struct CDCLineCoding *)data;
+                if ((coding->dwDTERate == 0) && (_baud == 1200)) {
+                    executeSoftReset(ENTER_BOOTLOADER_ON_BOOT);
+                }
+                _baud = coding->dwDTERate;
+                _stopBits = coding->bCharFormat;
+                _parity = coding->bParityType;
+                _dataBits = coding->bDataBits;
+                return true;
             }
-        }
+            break;
     }
+    return false;
+}
 
+bool CDCACM::onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
     if (ep == _epBulk) {
 
 
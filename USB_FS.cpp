@@ -36,6 +36,9 @@
 #define PA_TO_KVA0(pa)  ((pa) | 0x80000000)  // cachable
 #define PA_TO_KVA1(pa)  ((pa) | 0xa000000
 
+// The USB module can only reach RAM, not flash.
+#define IS_RAM_ADDRESS(v) (KVA_TO_PA(v) < 0x1D000000)
+
 /*-------------- USB FS ---------------*/
 
 USBFS *USBFS::_this;
@@ -184,7 +187,7 @@ bool USBFS::addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t si
 			case 14: U1EP14bits.EPTXEN = 1; break;
 			case 15: U1EP15bits.EPTXEN = 1; break;
 		}
-		_enabledEndpoints |= (1 << (id + 16));
+		_enabledEndpoints |= (1UL << (id + 16));
 	}
 
 	
@@ -218,14 +221,32 @@ bool USBFS::canEnqueuePacket(uint8_t ep) {
 }
 
 bool USBFS::enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
+    return queuePacket(ep, data, len, false);
+}
+
+// Queue one packet on an endpoint. Normally the data is copied into the
+// endpoint's ping-pong buffer. If direct is set, and the data is big enough
+// and is in RAM where the USB module can reach it, the BDT entry is pointed
+// straight at the caller's memory instead, which must then stay untouched
+// until the packet has been sent.
+bool USBFS::queuePacket(uint8_t ep, const uint8_t *data, uint32_t len, bool direct) {
 	bool sent = false;
 
     uint8_t buffer = _endpointBuffers[ep].txAB;
     uint8_t bdt_entry = buffer ? 3 : 2;
 
+    direct = direct && (len >= USB_DIRECT_MIN) && IS_RAM_ADDRESS((uint32_t)data);
+
+    if (_manager) _manager->traceEvent(USB_TRACE_IN, ep | 0x80, data, len);
+
     while (!sent) {
         if ((_bufferDescriptorTable[ep][bdt_entry].flags & 0x80) == 0) {
-            if (len > 0) memcpy(_endpointBuffers[ep].tx[buffer], data, min(len, _endpointBuffers[ep].size));
+            if (direct) {
+                _bufferDescriptorTable[ep][bdt_entry].buffer = (uint8_t *)KVA_TO_PA((uint32_t)data);
+            } else {
+                if (len > 0) memcpy(_endpointBuffers[ep].tx[buffer], data, min(len, _endpointBuffers[ep].size));
+                _bufferDescriptorTable[ep][bdt_entry].buffer = (uint8_t *)KVA_TO_PA((uint32_t)_endpointBuffers[ep].tx[buffer]);
+            }
             _bufferDescriptorTable[ep][bdt_entry].flags = (len << 16) | 0x00 | _endpointBuffers[ep].data; 
             sent = true;
             _bufferDescriptorTable[ep][bdt_entry].flags |= 0x80;
@@ -238,57 +259,197 @@ bool USBFS::enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
 	return true;
 }
 
+bool USBFS::isTransmitting(uint8_t ep) {
+    return ((_bufferDescriptorTable[ep][2].flags & 0x80) != 0) || ((_bufferDescriptorTable[ep][3].flags & 0x80) != 0);
+}
+
+// Called when an IN transaction completes. Transfers whose last packet has
+// gone are finished off, then any free ping-pong buffers are filled from the
+// transfers still waiting, so the next one starts without missing a frame.
+void USBFS::continueTransmit(uint8_t ep) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    while (epb->queued > 0) {
+        struct usbTransfer *t = &epb->queue[epb->head];
+        if (_bufferDescriptorTable[ep][t->slot].flags & 0x80) {
+            break;
+        }
+
+        uint8_t *buffer = t->buffer;
+        uint32_t length = t->length;
+        bool copied = t->copied;
+        USBTransferCallback cb = t->callback;
+        void *ctx = t->context;
+
+        epb->head = (epb->head + 1) % USB_TX_QUEUE_DEPTH;
+        epb->count--;
+        epb->queued--;
+
+        if (copied) {
+            _manager->releaseBuffer(buffer);
+        }
+        if (cb != NULL) {
+            cb(ep, length, ctx);
+        }
+    }
+
+    while ((epb->queued < epb->count) && canEnqueuePacket(ep)) {
+        struct usbTransfer *t = &epb->queue[(epb->head + epb->queued) % USB_TX_QUEUE_DEPTH];
+        uint32_t toSend = min(epb->size, t->length - epb->sent);
+        t->slot = epb->txAB ? 3 : 2;
+        queuePacket(ep, t->buffer + epb->sent, toSend, true);
+        epb->sent += toSend;
+        if (epb->sent >= t->length) {
+            epb->sent = 0;
+            epb->queued++;
+        }
+    }
+}
+
+// Add a transfer to the end of an endpoint's queue, starting it if the
+// endpoint is idle. Returns false if the queue is full.
+bool USBFS::queueTransfer(uint8_t ep, const uint8_t *data, uint32_t len, bool copied, USBTransferCallback cb, void *ctx) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    uint32_t s = disableInterrupts();
+    if (epb->count >= USB_TX_QUEUE_DEPTH) {
+        restoreInterrupts(s);
+        return false;
+    }
+
+    struct usbTransfer *t = &epb->queue[(epb->head + epb->count) % USB_TX_QUEUE_DEPTH];
+    t->buffer = (uint8_t *)data;
+    t->length = len;
+    t->copied = copied;
+    t->callback = cb;
+    t->context = ctx;
+    epb->count++;
+
+    continueTransmit(ep);
+    restoreInterrupts(s);
+    return true;
+}
+
+// Throw away everything queued on an endpoint: take back any buffer
+// descriptors still armed, and complete the transfers with
+// USB_TRANSFER_ABORTED.
+void USBFS::abortTransfers(uint8_t ep) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    for (int i = 2; i < 4; i++) {
+        if (_bufferDescriptorTable[ep][i].flags & 0x80) {
+            _bufferDescriptorTable[ep][i].flags &= ~0x80;
+            // The SIE will look in this entry next
+            epb->txAB = 1 - epb->txAB;
+        }
+    }
+
+    // A callback may queue a new transfer, which is left alone
+    uint8_t n = epb->count;
+    epb->queued = 0;
+    epb->sent = 0;
+    while (n-- > 0) {
+        struct usbTransfer *t = &epb->queue[epb->head];
+        uint8_t *buffer = t->buffer;
+        bool copied = t->copied;
+        USBTransferCallback cb = t->callback;
+        void *ctx = t->context;
+
+        epb->head = (epb->head + 1) % USB_TX_QUEUE_DEPTH;
+        epb->count--;
+
+        if (copied) {
+            _manager->releaseBuffer(buffer);
+        }
+        if (cb != NULL) {
+            cb(ep, USB_TRANSFER_ABORTED, ctx);
+        }
+    }
+}
+
 bool USBFS::sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
+    if (ep > 15) return false;
 
     uint32_t ts = millis();
 
-    if (_inIsr) {
-        while (_endpointBuffers[ep].buffer != NULL) {
-            if (millis() - ts > USB_TX_TIMEOUT) return false;
-            if (canEnqueuePacket(ep)) {
-                if (_endpointBuffers[ep].length > 0) {
-                    uint32_t toSend = min(_endpointBuffers[ep].size, _endpointBuffers[ep].length);
-                    enqueuePacket(ep, _endpointBuffers[ep].bufferPtr, toSend);
-                    _endpointBuffers[ep].length -= toSend;
-                    _endpointBuffers[ep].bufferPtr += toSend;
-                } else {
-                    if (_endpointBuffers[ep].buffer != NULL) {
-                        free(_endpointBuffers[ep].buffer);
-                        _endpointBuffers[ep].buffer = NULL;
-                    }
-                }
-
-            }
+    // Wait for room in the queue. Inside the interrupt nothing else will
+    // move it along, so do it here.
+    while (_endpointBuffers[ep].count >= USB_TX_QUEUE_DEPTH) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
         }
-    } else {
-        while (_endpointBuffers[ep].buffer != NULL) {
-            if (millis() - ts > USB_TX_TIMEOUT) return false;
+        if (_inIsr) {
+            continueTransmit(ep);
         }
     }
 
-    _endpointBuffers[ep].length = len;
-    _endpointBuffers[ep].buffer = (uint8_t *)malloc(len);
-    if (!_endpointBuffers[ep].buffer) {
+    if (len == 0) {
+        return queueTransfer(ep, NULL, 0, false, NULL, NULL);
+    }
+
+    uint8_t *copy = (uint8_t *)_manager->allocateBuffer(len);
+    if (!copy) {
+        return sendBufferWait(ep, data, len);
+    }
+    memcpy(copy, data, len);
+
+    if (!queueTransfer(ep, copy, len, true, NULL, NULL)) {
+        _manager->releaseBuffer(copy);
         return false;
     }
-    memcpy(_endpointBuffers[ep].buffer, data, len);
-    _endpointBuffers[ep].bufferPtr = _endpointBuffers[ep].buffer;
+    return true;
+}
 
-    ts = millis();
-    while (!canEnqueuePacket(ep)) {
-        if (millis() - ts > USB_TX_TIMEOUT) return false;
+// Used when there is no pool block to copy a buffer into: wait for the queue
+// to empty, then send the buffer packet by packet through the ping-pong
+// buffers and wait until the last packet has gone, so the caller's buffer is
+// finished with on return.
+bool USBFS::sendBufferWait(uint8_t ep, const uint8_t *data, uint32_t len) {
+    uint32_t pos = 0;
+    uint32_t ts = millis();
+
+    while (_endpointBuffers[ep].count > 0) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
+        if (_inIsr) {
+            continueTransmit(ep);
+        }
     }
 
-    uint32_t toSend = min(_endpointBuffers[ep].size, _endpointBuffers[ep].length);
-    enqueuePacket(ep, _endpointBuffers[ep].bufferPtr, toSend);
-    _endpointBuffers[ep].length -= toSend;
-    _endpointBuffers[ep].bufferPtr += toSend;
+    do {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
+        if (canEnqueuePacket(ep)) {
+            uint32_t toSend = min(_endpointBuffers[ep].size, len - pos);
+            queuePacket(ep, &data[pos], toSend, false);
+            pos += toSend;
+        }
+    } while (pos < len);
 
+    while (isTransmitting(ep)) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
+    }
     return true;
 }
 
+// Asynchronous version of sendBuffer. No private copy of the buffer is
+// made, so it must stay valid until the callback is called.
+// Returns false straight away if the endpoint's queue is full.
+bool USBFS::submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx) {
+    if (ep > 15) return false;
+    return queueTransfer(ep, data, len, false, cb, ctx);
+}
+
 void USBFS::handleInterrupt() {
-    uint32_t toSend;
+    uint32_t start = USBManager::profileStart();
     _inIsr = true;
 
 	if (U1IRbits.TRNIF) {
@@ -301,27 +462,30 @@ void USBFS::handleInterrupt() {
 		switch (pid) {
 			case 0x01: // OUT
                 RXOn();
+                if (_manager) _manager->countOut(ep, _bufferDescriptorTable[ep][bdt_slot].flags >> 16);
                 if (_manager) _manager->onOutPacket(ep, _endpointBuffers[ep].rx[U1STATbits.PPBI], _bufferDescriptorTable[ep][bdt_slot].flags >> 16);
      //           _endpointBuffers[ep].data = _endpointBuffers[ep].data ? 0 : 0x40;
-				_bufferDescriptorTable[ep][bdt_slot].flags = (_endpointBuffers[ep].size << 16) | 0x80 | _endpointBuffers[ep].data; 
+                if (_rxHeld & (1 << ep)) {
+                    // Keep the entry until resumeEndpoint() so the host is NAKed
+                    _rxParked |= (1UL << ((ep << 1) | bdt_slot));
+                } else {
+                    _bufferDescriptorTable[ep][bdt_slot].flags = (_endpointBuffers[ep].size << 16) | 0x80 | _endpointBuffers[ep].data;
+                }
 				break;
 			case 0x09: // IN
                 TXOn();
-                if (_endpointBuffers[ep].length > 0) {
-                    toSend = min(_endpointBuffers[ep].size, _endpointBuffers[ep].length);
-                    enqueuePacket(ep, _endpointBuffers[ep].bufferPtr, toSend);
-                    _endpointBuffers[ep].length -= toSend;
-                    _endpointBuffers[ep].bufferPtr += toSend;
-                } else {
-                    if (_endpointBuffers[ep].buffer != NULL) {
-                        free(_endpointBuffers[ep].buffer);
-                        _endpointBuffers[ep].buffer = NULL;
-                    }
-                }
+                if (_manager) _manager->countIn(ep, _bufferDescriptorTable[ep][bdt_slot].flags >> 16);
+                continueTransmit(ep);
 
                 if (_manager) _manager->onInPacket(ep, _endpointBuffers[ep].rx[U1STATbits.PPBI], _bufferDescriptorTable[ep][bdt_slot].flags >> 16);
 				break;
 			case 0x0d: // SETUP
+                // A new request ends any stall left from the last one, and
+                // anything it still had to send
+                if (ep == 0) {
+                    clearStall(0);
+                    abortTransfers(0);
+                }
 				_endpointBuffers[ep].data = 0x40;
                 if (_manager) _manager->onSetupPacket(ep, _endpointBuffers[ep].rx[U1STATbits.PPBI], _bufferDescriptorTable[ep][bdt_slot].flags >> 16);
 				_bufferDescriptorTable[ep][bdt_slot].flags = (_endpointBuffers[ep].size << 16) | 0x80;
@@ -333,6 +497,13 @@ void USBFS::handleInterrupt() {
 		U1CONbits.TOKBUSY=0;
 	}
 	if (U1IRbits.URSTIF) {
+        uint32_t resetStart = USBManager::profileStart();
+		for (int i = 0; i < 16; i++) {
+            abortTransfers(i);
+        }
+        if (_manager) _manager->onBusReset();
+        _rxHeld = 0;
+        _rxParked = 0;
 		U1IEbits.IDLEIE = 1;
 		U1IEbits.TRNIE = 1;
 		U1ADDR = 0;
@@ -342,13 +513,16 @@ void USBFS::handleInterrupt() {
 			_endpointBuffers[i].txAB = 0;
             _endpointBuffers[i].data = 0x40;
 
-            _bufferDescriptorTable[i][0].flags |= 0x80;
-            _bufferDescriptorTable[i][1].flags |= 0x80;
+            // Written in full: an entry parked while the endpoint was
+            // halted still holds its last packet's count and PID
+            _bufferDescriptorTable[i][0].flags = (_endpointBuffers[i].size << 16) | 0x80;
+            _bufferDescriptorTable[i][1].flags = (_endpointBuffers[i].size << 16) | 0x80;
 
             _bufferDescriptorTable[i][2].flags &= 0x7F;
             _bufferDescriptorTable[i][3].flags &= 0x7F;
 
 		}
+        if (_manager) _manager->profileEnd(USB_PROF_RESET, 0, resetStart);
 	}
 	if (U1IRbits.IDLEIF) {
 		U1IEbits.IDLEIE = 0;
@@ -359,12 +533,67 @@ void USBFS::handleInterrupt() {
 		U1IEbits.RESUMEIE = 0;
 	}
 	if (U1EIR) {
-    
+        if (_manager) _manager->countErrors(U1EIR);
 	}
 	U1EIR = 0xFF;
 	U1IR = 0xFF;
 	clearIntFlag(_USB_IRQ);
     _inIsr = false;
+    if (_manager) _manager->profileEnd(USB_PROF_ISR, 0, start);
+}
+
+// Flow control: OUT packets on a halted endpoint aren't given a fresh
+// buffer, so once both BDT entries are used the host is NAKed.
+void USBFS::haltEndpoint(uint8_t ep) {
+    _rxHeld |= (1 << (ep & 0x0F));
+}
+
+void USBFS::resumeEndpoint(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+    uint32_t s = disableInterrupts();
+    _rxHeld &= ~(1 << id);
+    for (int i = 0; i < 2; i++) {
+        if (_rxParked & (1UL << ((id << 1) | i))) {
+            _rxParked &= ~(1UL << ((id << 1) | i));
+            _bufferDescriptorTable[id][i].flags = (_endpointBuffers[id].size << 16) | 0x80 | _endpointBuffers[id].data;
+        }
+    }
+    restoreInterrupts(s);
+}
+
+// Answer the endpoint with STALL until the stall is cleared. The BDT
+// entries are armed with BSTALL set, so the next token in that direction
+// gets a STALL handshake.
+void USBFS::stallEndpoint(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+
+    if ((id == 0) || (ep & 0x80)) {
+        uint8_t bdt_entry = _endpointBuffers[id].txAB ? 3 : 2;
+        if ((_bufferDescriptorTable[id][bdt_entry].flags & 0x80) == 0) {
+            _bufferDescriptorTable[id][bdt_entry].flags = 0x84;
+        }
+    }
+    if ((id == 0) || !(ep & 0x80)) {
+        _bufferDescriptorTable[id][0].flags |= 0x04;
+        _bufferDescriptorTable[id][1].flags |= 0x04;
+    }
+}
+
+void USBFS::clearStall(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+
+    if ((id == 0) || (ep & 0x80)) {
+        for (int i = 2; i < 4; i++) {
+            if (_bufferDescriptorTable[id][i].flags & 0x04) {
+                _bufferDescriptorTable[id][i].flags = 0;
+            }
+        }
+        _endpointBuffers[id].data = 0;
+    }
+    if ((id == 0) || !(ep & 0x80)) {
+        _bufferDescriptorTable[id][0].flags &= ~0x04;
+        _bufferDescriptorTable[id][1].flags &= ~0x04;
+    }
 }
 
 bool USBFS::setAddress(uint8_t address) {
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017, Majenko Technologies
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of Majenko Technologies nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <USB.h>
+
+/*
+ * Share out the USBHS endpoint FIFO RAM. Each FIFO is a power of two from
+ * 8 to 4096 bytes, and the core is told its size as log2(bytes) - 3 and its
+ * address in 8 byte units. EP0 has the first 64 bytes to itself. None of
+ * this touches the hardware, so it builds (and is checked) on a PC too.
+ */
+
+// The FIFOSZ code for a FIFO of at least the given size, or
+// USB_FIFO_TOO_BIG if no FIFO is that large
+uint8_t USBFifoAllocator::sizeCode(uint32_t bytes) {
+    uint8_t sz = 0;
+    while ((1UL << (sz + 3)) < bytes) {
+        sz++;
+        if (sz > 9) {
+            return USB_FIFO_TOO_BIG;
+        }
+    }
+    return sz;
+}
+
+// Find room for an endpoint's FIFO. Bulk and isochronous endpoints get room
+// for two packets, so one can be on the bus while the other is loaded or
+// read; if that won't fit they make do with one.
+bool USBFifoAllocator::allocate(uint32_t bytes, uint8_t type, struct USBFifoSlot *slot) {
+    uint8_t sz = sizeCode(bytes);
+    if (sz == USB_FIFO_TOO_BIG) {
+        _failures++;
+        return false;
+    }
+
+    uint32_t units = (1UL << (sz + 3)) / 8;
+    bool dpb = (type == EP_BLK) || (type == EP_ISO);
+    if (dpb && (_offset + units * 2 > USB_FIFO_SIZE / 8)) {
+        dpb = false;
+    }
+    if (_offset + units > USB_FIFO_SIZE / 8) {
+        _failures++;
+        return false;
+    }
+
+    slot->address = _offset;
+    slot->sz = sz;
+    slot->dpb = dpb;
+    _offset += dpb ? units * 2 : units;
+    return true;
+}
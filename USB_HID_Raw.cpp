@@ -138,11 +138,6 @@ bool HID_Raw::onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t
                 return true;
             }
             break;
-        case 0x2109: {
-                _nextPacketIsMine = true;
-                return true;
-            }
-            break;
 
     }
     return false;
@@ -159,16 +154,22 @@ bool HID_Raw::onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l)
     return false;
 }
 
-bool HID_Raw::onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
-    if (ep == 0) {
-        if (_nextPacketIsMine == true) {
-            _features[data[0]] = data[1];
-            _manager->sendBuffer(0, NULL, 0);
-            _nextPacketIsMine = false;
-            return true;
-        }
+bool HID_Raw::onControlOut(uint8_t target, uint8_t *setup, uint8_t *data, uint32_t l) {
+    if (target != _ifInt) return false;
+
+    uint16_t signature = (setup[0] << 8) | setup[1];
+    switch (signature) {
+        case 0x2109: {
+                if (l < 2) return false;
+                _features[data[0]] = data[1];
+                return true;
+            }
+            break;
     }
+    return false;
+}
 
+bool HID_Raw::onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
     if (ep == _epInt) {
         return true;
     }
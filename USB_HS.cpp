@@ -36,10 +36,124 @@
 #define PA_TO_KVA0(pa)  ((pa) | 0x80000000)  // cachable
 #define PA_TO_KVA1(pa)  ((pa) | 0xa000000
 
+// The DMA controller can only reach RAM, not flash.
+#define IS_RAM_ADDRESS(v) (KVA_TO_PA(v) < 0x1D000000)
+#define IS_KSEG0(v) (((v) & 0xE0000000) == 0x80000000)
+
+// Each DMA channel has control, address and count registers, with the
+// next channel's 16 bytes further on.
+#define DMA_C(ch) (*(&USBDMA1C + ((ch) * 4)))
+#define DMA_A(ch) (*(&USBDMA1A + ((ch) * 4)))
+#define DMA_N(ch) (*(&USBDMA1N + ((ch) * 4)))
+
+#define DMA_ENABLE 0x0001
+#define DMA_TX 0x0002               // Memory to FIFO
+#define DMA_MODE1 0x0004            // Several packets, each requested by the endpoint
+#define DMA_IE 0x0008
+#define DMA_EP(n) ((n) << 4)
+#define DMA_ERROR 0x0100
+#define DMA_INCR16 0x0600           // 16 beat bursts
+
+#define CACHE_LINE 16
+
+static volatile uint32_t *endpointFifo(uint8_t ep) {
+    switch (ep) {
+        case 0: return &USBFIFO0;
+        case 1: return &USBFIFO1;
+        case 2: return &USBFIFO2;
+        case 3: return &USBFIFO3;
+        case 4: return &USBFIFO4;
+        case 5: return &USBFIFO5;
+        case 6: return &USBFIFO6;
+        case 7: return &USBFIFO7;
+    }
+    return NULL;
+}
+
+// Write any of the buffer that's only in the data cache out to RAM, so the
+// DMA controller reads what the CPU wrote.
+static void cacheWriteback(const uint8_t *buffer, uint32_t len) {
+    uintptr_t addr = (uintptr_t)buffer;
+    if (!IS_KSEG0(addr)) return;
+    uintptr_t end = addr + len;
+    for (addr &= ~(CACHE_LINE - 1); addr < end; addr += CACHE_LINE) {
+        __asm__ volatile ("cache 0x19, 0(%0)" : : "r" (addr));     // Hit_Writeback_D
+    }
+    __asm__ volatile ("sync");
+}
+
+// Drop the buffer's lines from the data cache, so the CPU reads what the
+// DMA controller wrote. The buffer must own all of its lines.
+static void cacheInvalidate(uint8_t *buffer, uint32_t len) {
+    uintptr_t addr = (uintptr_t)buffer;
+    if (!IS_KSEG0(addr)) return;
+    uintptr_t end = addr + len;
+    for (; addr < end; addr += CACHE_LINE) {
+        __asm__ volatile ("cache 0x11, 0(%0)" : : "r" (addr));     // Hit_Invalidate_D
+    }
+    __asm__ volatile ("sync");
+}
+
 /*-------------- USB FS ---------------*/
 
 USBHS *USBHS::_this;
 
+// Copy a packet out of an endpoint's FIFO. The size of each access to the
+// FIFO register sets how many bytes it takes, so whole words are read
+// while there are four or more bytes left, then single bytes.
+void USBHS::readFifo(uint8_t ep, uint8_t *data, uint32_t len) {
+    volatile uint32_t *fifo = endpointFifo(ep);
+    if (fifo == NULL) return;
+    uint32_t words = len >> 2;
+
+    if (((uintptr_t)data & 3) == 0) {
+        uint32_t *d = (uint32_t *)data;
+        while (words--) {
+            *d++ = *fifo;
+        }
+        data = (uint8_t *)d;
+    } else {
+        while (words--) {
+            uint32_t w = *fifo;
+            data[0] = w;
+            data[1] = w >> 8;
+            data[2] = w >> 16;
+            data[3] = w >> 24;
+            data += 4;
+        }
+    }
+
+    volatile uint8_t *fifo8 = (volatile uint8_t *)fifo;
+    for (len &= 3; len > 0; len--) {
+        *data++ = *fifo8;
+    }
+}
+
+// Copy a packet into an endpoint's FIFO, a word at a time as far as possible
+void USBHS::writeFifo(uint8_t ep, const uint8_t *data, uint32_t len) {
+    volatile uint32_t *fifo = endpointFifo(ep);
+    if (fifo == NULL) return;
+    uint32_t words = len >> 2;
+
+    if (((uintptr_t)data & 3) == 0) {
+        const uint32_t *d = (const uint32_t *)data;
+        while (words--) {
+            *fifo = *d++;
+        }
+        data = (const uint8_t *)d;
+    } else {
+        while (words--) {
+            *fifo = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+            data += 4;
+        }
+    }
+
+    volatile uint8_t *fifo8 = (volatile uint8_t *)fifo;
+    for (len &= 3; len > 0; len--) {
+        *fifo8 = *data++;
+    }
+}
+
 #define WFB(X) (((X) + 3) / 4)
 
 #ifdef PIN_LED_TX
@@ -116,6 +230,8 @@ bool USBFS::enableUSB() {
     USBCRCONbits.USBIE = 1;
 #endif
 
+    enableDma();
+
     addEndpoint(0, EP_IN, EP_CTL, 64, _ctlRxA, _ctlRxB);
     addEndpoint(0, EP_OUT, EP_CTL, 64, _ctlTxA, _ctlTxB);
 
@@ -152,6 +268,8 @@ bool USBHS::enableUSB() {
     USBCRCONbits.USBIE = 1;
 #endif
 
+    enableDma();
+
     addEndpoint(0, EP_IN, EP_CTL, 64, _ctlRxA, _ctlRxB);
     addEndpoint(0, EP_OUT, EP_CTL, 64, _ctlTxA, _ctlTxB);
 
@@ -161,23 +279,104 @@ bool USBHS::enableUSB() {
 bool USBHS::disableUSB() {
 	return true;
 }
-	
+
+// The manager is about to add every endpoint again, so the FIFO RAM can be
+// shared out afresh. Each endpoint keeps its DMA channel.
+void USBHS::resetEndpoints() {
+    _fifo.reset();
+    _autoTx = 0;
+    _autoRx = 0;
+}
+
+void USBHS::enableDma() {
+#ifndef USB_NO_DMA
+    setIntVector(_USB_DMA_VECTOR, _usbDmaInterrupt);
+    setIntPriority(_USB_DMA_VECTOR, 6, 0);
+    clearIntFlag(_USB_DMA_VECTOR);
+    setIntEnable(_USB_DMA_VECTOR);
+#endif
+}
+
+// Give an endpoint direction a DMA channel of its own, if there are any
+// left. An endpoint that is added again keeps the channel it had.
+bool USBHS::allocateDma(uint8_t ep, uint8_t dir) {
+#ifdef USB_NO_DMA
+    return false;
+#else
+    if (_dmaChannel[ep][dir] != 0) return true;
+    for (uint8_t ch = 0; ch < USB_DMA_CHANNELS; ch++) {
+        if (!(_dmaAllocated & (1 << ch))) {
+            _dmaAllocated |= (1 << ch);
+            _dmaChannel[ep][dir] = ch + 1;
+            return true;
+        }
+    }
+    return false;
+#endif
+}
+
+// Start the endpoint's DMA channel moving a packet between memory and the
+// FIFO. Returns false if the CPU has to do it instead: the endpoint has no
+// channel, the packet is small, or the buffer isn't somewhere the DMA
+// controller can safely use.
+bool USBHS::startDma(uint8_t ep, bool tx, uint8_t *buffer, uint32_t len) {
+#ifdef USB_NO_DMA
+    return false;
+#else
+    uint8_t ch = _dmaChannel[ep][tx ? 1 : 0];
+    if ((ch == 0) || (len < USB_DMA_MIN)) return false;
+    ch--;
+
+    uintptr_t addr = (uintptr_t)buffer;
+    if (!IS_RAM_ADDRESS(addr) || (addr & 3)) return false;
+
+    if (tx) {
+        cacheWriteback(buffer, len);
+        _dmaBusy |= (1 << ep);
+    } else {
+        // Invalidating the lines afterwards would throw away anything else
+        // the CPU had written to them, so the buffer must have them all to
+        // itself.
+        if ((addr & (CACHE_LINE - 1)) || (_endpointBuffers[ep].size & (CACHE_LINE - 1))) return false;
+        cacheInvalidate(buffer, _endpointBuffers[ep].size);
+        _dmaRxBusy |= (1 << ep);
+    }
+
+    _dma[ch].ep = ep;
+    _dma[ch].tx = tx;
+    _dma[ch].buffer = buffer;
+    _dma[ch].length = len;
+
+    uint32_t mode = (len > _endpointBuffers[ep].size) ? DMA_MODE1 : 0;
+
+    DMA_A(ch) = KVA_TO_PA(addr);
+    DMA_N(ch) = len;
+    DMA_C(ch) = DMA_ENABLE | DMA_IE | DMA_INCR16 | DMA_EP(ep) | mode | (tx ? DMA_TX : 0);
+    return true;
+#endif
+}
+
 
 bool USBHS::addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b) {
+    return configureEndpoint(id, direction, type, size, 1, a, b);
+}
+
+// Two transactions at most. Two of 1024 bytes take a 2048 byte FIFO,
+// single buffered; three would round up to 4096 bytes, and EP0's 64 bytes
+// leave less than that.
+bool USBHS::addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b) {
+    if ((id == 0) || (transactions < 1) || (transactions > 2) || (size > 1024)) return false;
+    return configureEndpoint(id, direction, type, size, transactions, a, b);
+}
+
+// Set up an endpoint. A high-bandwidth endpoint's FIFO holds all of a
+// microframe's transactions as one packet, which the hardware splits up
+// on the way out and puts together on the way in, so as far as the rest
+// of the driver is concerned its packets are size * transactions bytes.
+bool USBHS::configureEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b) {
 	if (id > 7) return false;
 
-    uint8_t sz = 0;
-    if (size <= 8192)   sz = 0b1101;
-    if (size <= 4096)   sz = 0b1100;
-    if (size <= 2048)   sz = 0b1011;
-    if (size <= 1024)   sz = 0b1010;
-    if (size <= 512)    sz = 0b1001;
-    if (size <= 256)    sz = 0b1000;
-    if (size <= 128)    sz = 0b0111;
-    if (size <= 64)     sz = 0b0110;
-    if (size <= 32)     sz = 0b0101;
-    if (size <= 16)     sz = 0b0100;
-    if (size <= 8)      sz = 0b0011;
+    uint32_t bytes = size * transactions;
 
     if (id == 0) {
         USBCSR1bits.EP0IE = 1;
@@ -193,12 +392,14 @@ bool USBHS::addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t si
 
     } else {
 
+        struct USBFifoSlot fifo;
+        if (!_fifo.allocate(bytes, type, &fifo)) {
+            return false;
+        }
+
         uint8_t ep = USBCSR3bits.ENDPOINT;
         USBCSR3bits.ENDPOINT = id;
 
-
-        USBIENCSR0bits.TXMAXP = size;
-
         switch (type) {
             case EP_CTL: USBIENCSR3bits.PROTOCOL = 0b00; break;
             case EP_ISO: USBIENCSR3bits.PROTOCOL = 0b01; break;
@@ -206,45 +407,68 @@ bool USBHS::addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t si
             case EP_INT: USBIENCSR3bits.PROTOCOL = 0b11; break;
         }
 
-        _endpointBuffers[id].size = size;
+        _endpointBuffers[id].size = bytes;
 
         if (direction == EP_IN) {
             _endpointBuffers[id].rx[0] = a;
             _endpointBuffers[id].rx[1] = b;
-            USBFIFOAbits.RXFIFOAD = _fifoOffset;
-            USBIENCSR0bits.CLRDT = 1;
-            USBOTGbits.RXFIFOSZ = sz;
+            USBIENCSR1bits.RXMAXP = size;
+            USBIENCSR1bits.MULT = transactions - 1;
+            USBFIFOAbits.RXFIFOAD = fifo.address;
+            USBOTGbits.RXFIFOSZ = fifo.sz;
+            USBOTGbits.RXDPB = fifo.dpb;
+            USBIENCSR1bits.FLUSH = 1;
+            USBIENCSR1bits.CLRDT = 1;
 
-            _fifoOffset += size / 8;
             switch (id) {
-                case 1: USBCSR2bits.EP1RXIE = 1;
-                case 2: USBCSR2bits.EP2RXIE = 1;
-                case 3: USBCSR2bits.EP3RXIE = 1;
-                case 4: USBCSR2bits.EP4RXIE = 1;
-                case 5: USBCSR2bits.EP5RXIE = 1;
-                case 6: USBCSR2bits.EP6RXIE = 1;
-                case 7: USBCSR2bits.EP7RXIE = 1;
+                case 1: USBCSR2bits.EP1RXIE = 1; break;
+                case 2: USBCSR2bits.EP2RXIE = 1; break;
+                case 3: USBCSR2bits.EP3RXIE = 1; break;
+                case 4: USBCSR2bits.EP4RXIE = 1; break;
+                case 5: USBCSR2bits.EP5RXIE = 1; break;
+                case 6: USBCSR2bits.EP6RXIE = 1; break;
+                case 7: USBCSR2bits.EP7RXIE = 1; break;
             }
 
         } else if (direction == EP_OUT) {
             _endpointBuffers[id].tx[0] = a;
             _endpointBuffers[id].tx[1] = b;
-            USBFIFOAbits.TXFIFOAD = _fifoOffset;
+            USBIENCSR0bits.TXMAXP = size;
+            USBIENCSR0bits.MULT = transactions - 1;
+            USBFIFOAbits.TXFIFOAD = fifo.address;
+            USBOTGbits.TXFIFOSZ = fifo.sz;
+            USBOTGbits.TXDPB = fifo.dpb;
+            USBIENCSR0bits.FLUSH = 1;
             USBIENCSR0bits.CLRDT = 1;
-            USBOTGbits.RXFIFOSZ = sz;
 
-            _fifoOffset += size / 8;
             switch (id) {
-                case 1: USBCSR1bits.EP1TXIE = 1;
-                case 2: USBCSR1bits.EP2TXIE = 1;
-                case 3: USBCSR1bits.EP3TXIE = 1;
-                case 4: USBCSR1bits.EP4TXIE = 1;
-                case 5: USBCSR1bits.EP5TXIE = 1;
-                case 6: USBCSR1bits.EP6TXIE = 1;
-                case 7: USBCSR1bits.EP7TXIE = 1;
+                case 1: USBCSR1bits.EP1TXIE = 1; break;
+                case 2: USBCSR1bits.EP2TXIE = 1; break;
+                case 3: USBCSR1bits.EP3TXIE = 1; break;
+                case 4: USBCSR1bits.EP4TXIE = 1; break;
+                case 5: USBCSR1bits.EP5TXIE = 1; break;
+                case 6: USBCSR1bits.EP6TXIE = 1; break;
+                case 7: USBCSR1bits.EP7TXIE = 1; break;
             }
         }
 
+        bool dma = false;
+        if ((type == EP_BLK) || ((type == EP_INT) && (bytes > 64))) {
+            dma = allocateDma(id, (direction == EP_IN) ? 0 : 1);
+        }
+
+        // In auto mode the hardware sends each full packet as soon as it is
+        // in the FIFO, and frees each full received packet once it has been
+        // read, without the CPU setting TXPKTRDY or clearing RXPKTRDY.
+        bool autoMode = _autoBulk && dma && (type == EP_BLK);
+        if (direction == EP_IN) {
+            USBIENCSR1bits.AUTOCLR = autoMode;
+            _autoRx = autoMode ? (_autoRx | (1 << id)) : (_autoRx & ~(1 << id));
+        } else {
+            USBIENCSR0bits.AUTOSET = autoMode;
+            _autoTx = autoMode ? (_autoTx | (1 << id)) : (_autoTx & ~(1 << id));
+        }
+
         if (type == EP_ISO) {
             USBIENCSR1bits.ISO = 1;
         } else {
@@ -265,6 +489,11 @@ bool USBHS::canEnqueuePacket(uint8_t ep) {
         return (USBE0CSR0bits.TXRDY == 0);
     }
 
+    // TXPKTRDY isn't set until the DMA has filled the FIFO
+    if (_dmaBusy & (1 << ep)) {
+        return false;
+    }
+
     bool rdy = false;
     uint8_t oep = USBCSR3bits.ENDPOINT;
     USBCSR3bits.ENDPOINT = ep;
@@ -275,24 +504,59 @@ bool USBHS::canEnqueuePacket(uint8_t ep) {
 }
 
 bool USBHS::enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
+    return queuePacket(ep, data, len, false);
+}
+
+// Put one packet in an endpoint's FIFO. If dma is set, and the endpoint and
+// buffer allow it, the DMA controller copies the packet and the buffer must
+// stay untouched until it has been sent.
+bool USBHS::queuePacket(uint8_t ep, const uint8_t *data, uint32_t len, bool dma) {
+    if (ep > 7) return false;
     if (!canEnqueuePacket(ep)) return false;
 
-    volatile uint8_t *fifo = NULL;
-    switch (ep) {
-        case 0: fifo = (uint8_t *)&USBFIFO0; break;
-        case 1: fifo = (uint8_t *)&USBFIFO1; break;
-        case 2: fifo = (uint8_t *)&USBFIFO2; break;
-        case 3: fifo = (uint8_t *)&USBFIFO3; break;
-        case 4: fifo = (uint8_t *)&USBFIFO4; break;
-        case 5: fifo = (uint8_t *)&USBFIFO5; break;
-        case 6: fifo = (uint8_t *)&USBFIFO6; break;
-        case 7: fifo = (uint8_t *)&USBFIFO7; break;
+    if (_manager) _manager->countIn(ep, len);
+    if (_manager) _manager->traceEvent(USB_TRACE_IN, ep | 0x80, data, len);
+
+    // The DMA interrupt sets TXPKTRDY when the copy is done
+    if (dma && startDma(ep, true, (uint8_t *)data, len)) {
+        return true;
     }
-    if (fifo == NULL) return false;
 
-    for (uint32_t i = 0; i < len; i++) {
-        *fifo = data[i];
+    writePacket(ep, data, len);
+    return true;
+}
+
+// Hand several packets of a transfer to the DMA controller in one go. Only
+// for endpoints in auto mode: the endpoint asks the DMA controller for each
+// packet as there is room in the FIFO and AUTOSET sends it, so the CPU
+// hears nothing until the DMA has finished. Returns false if the packets
+// have to go one at a time instead.
+bool USBHS::queueBurst(uint8_t ep, const uint8_t *data, uint32_t len) {
+    uint32_t size = _endpointBuffers[ep].size;
+    if (!(_autoTx & (1 << ep)) || (len <= size)) return false;
+    if (!canEnqueuePacket(ep)) return false;
+    if (!startDma(ep, true, (uint8_t *)data, len)) return false;
+
+    uint8_t oep = USBCSR3bits.ENDPOINT;
+    USBCSR3bits.ENDPOINT = ep;
+    USBIENCSR0bits.MODE = 1;
+    USBIENCSR0bits.DMAREQMD = 1;
+    USBIENCSR0bits.DMAREQEN = 1;
+    USBCSR3bits.ENDPOINT = oep;
+
+    if (_manager) {
+        for (uint32_t pos = 0; pos < len; pos += size) {
+            uint32_t plen = min(size, len - pos);
+            _manager->countIn(ep, plen);
+            _manager->traceEvent(USB_TRACE_IN, ep | 0x80, data + pos, plen);
+        }
     }
+    return true;
+}
+
+// Copy a packet into an endpoint's FIFO with the CPU and mark it ready to go
+void USBHS::writePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
+    writeFifo(ep, data, len);
 
     if (ep == 0) {
         USBE0CSR0bits.TXRDY = 1; 
@@ -303,25 +567,185 @@ bool USBHS::enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
         USBIENCSR0bits.TXPKTRDY = 1; 
         USBCSR3bits.ENDPOINT = oep;
     }
-	return true;
+}
+
+// Called when a packet has gone from an endpoint's FIFO. The transfer it
+// finished is completed, and the next packet, from the same transfer or the
+// next one in the queue, goes straight into the FIFO.
+void USBHS::continueTransmit(uint8_t ep) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    while ((epb->queued > 0) && canEnqueuePacket(ep)) {
+        struct usbTransfer *t = &epb->queue[epb->head];
+
+        uint8_t *buffer = t->buffer;
+        uint32_t length = t->length;
+        bool copied = t->copied;
+        USBTransferCallback cb = t->callback;
+        void *ctx = t->context;
+
+        epb->head = (epb->head + 1) % USB_TX_QUEUE_DEPTH;
+        epb->count--;
+        epb->queued--;
+
+        if (copied) {
+            _manager->releaseBuffer(buffer);
+        }
+        if (cb != NULL) {
+            cb(ep, length, ctx);
+        }
+    }
+
+    if ((epb->queued < epb->count) && canEnqueuePacket(ep)) {
+        struct usbTransfer *t = &epb->queue[(epb->head + epb->queued) % USB_TX_QUEUE_DEPTH];
+        uint32_t remain = t->length - epb->sent;
+        uint32_t toSend = min(epb->size, remain);
+        if (queueBurst(ep, t->buffer + epb->sent, remain)) {
+            toSend = remain;
+        } else {
+            queuePacket(ep, t->buffer + epb->sent, toSend, true);
+        }
+        epb->sent += toSend;
+        if (epb->sent >= t->length) {
+            epb->sent = 0;
+            epb->queued++;
+        }
+    }
+}
+
+// Add a transfer to the end of an endpoint's queue, starting it if the
+// endpoint is idle. Returns false if the queue is full.
+bool USBHS::queueTransfer(uint8_t ep, const uint8_t *data, uint32_t len, bool copied, USBTransferCallback cb, void *ctx) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    uint32_t s = disableInterrupts();
+    if (epb->count >= USB_TX_QUEUE_DEPTH) {
+        restoreInterrupts(s);
+        return false;
+    }
+
+    struct usbTransfer *t = &epb->queue[(epb->head + epb->count) % USB_TX_QUEUE_DEPTH];
+    t->buffer = (uint8_t *)data;
+    t->length = len;
+    t->copied = copied;
+    t->callback = cb;
+    t->context = ctx;
+    epb->count++;
+
+    continueTransmit(ep);
+    restoreInterrupts(s);
+    return true;
+}
+
+// Throw away everything queued on an endpoint: flush whatever is waiting
+// in its FIFO, and complete the transfers with USB_TRANSFER_ABORTED.
+void USBHS::abortTransfers(uint8_t ep) {
+    struct epBuffer *epb = &_endpointBuffers[ep];
+
+    if (ep == 0) {
+        if (USBE0CSR0bits.TXRDY) {
+            USBE0CSR0bits.FLUSH = 1;
+        }
+    } else {
+        uint8_t oep = USBCSR3bits.ENDPOINT;
+        USBCSR3bits.ENDPOINT = ep;
+        // Twice, for a double-buffered FIFO
+        for (int i = 0; i < 2; i++) {
+            if (USBIENCSR0bits.TXPKTRDY) {
+                USBIENCSR0bits.FLUSH = 1;
+            }
+        }
+        USBCSR3bits.ENDPOINT = oep;
+    }
+
+    // A callback may queue a new transfer, which is left alone
+    uint8_t n = epb->count;
+    epb->queued = 0;
+    epb->sent = 0;
+    while (n-- > 0) {
+        struct usbTransfer *t = &epb->queue[epb->head];
+        uint8_t *buffer = t->buffer;
+        bool copied = t->copied;
+        USBTransferCallback cb = t->callback;
+        void *ctx = t->context;
+
+        epb->head = (epb->head + 1) % USB_TX_QUEUE_DEPTH;
+        epb->count--;
+
+        if (copied) {
+            _manager->releaseBuffer(buffer);
+        }
+        if (cb != NULL) {
+            cb(ep, USB_TRANSFER_ABORTED, ctx);
+        }
+    }
+}
+
+// Asynchronous version of sendBuffer. The buffer must stay valid until the
+// callback is called. Returns false straight away if the endpoint's queue
+// is full.
+bool USBHS::submitIn(uint8_t ep, const uint8_t *data, uint32_t len, USBTransferCallback cb, void *ctx) {
+    if (ep > 7) return false;
+    return queueTransfer(ep, data, len, false, cb, ctx);
 }
 
 bool USBHS::sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
+    if (ep > 7) return false;
+
+    uint32_t ts = millis();
+
+    // Wait for room in the queue. Inside the interrupt nothing else will
+    // move it along, so do it here.
+    while (_endpointBuffers[ep].count >= USB_TX_QUEUE_DEPTH) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
+        if (_inIsr) {
+            continueTransmit(ep);
+        }
+    }
+
+    if (len == 0) {
+        return queueTransfer(ep, NULL, 0, false, NULL, NULL);
+    }
+
+    uint8_t *copy = (uint8_t *)_manager->allocateBuffer(len);
+    if (!copy) {
+        return sendBufferWait(ep, data, len);
+    }
+    memcpy(copy, data, len);
+
+    if (!queueTransfer(ep, copy, len, true, NULL, NULL)) {
+        _manager->releaseBuffer(copy);
+        return false;
+    }
+    return true;
+}
+
+// Used when there is no pool block to copy a buffer into: wait for the queue
+// to empty, then write the buffer into the FIFO a packet at a time.
+bool USBHS::sendBufferWait(uint8_t ep, const uint8_t *data, uint32_t len) {
     uint32_t remain = len;
     uint32_t pos = 0;
-
     uint32_t psize = _endpointBuffers[ep].size;
 
-    if (len == 0) {
-        while (1) {
-            if (canEnqueuePacket(ep)) {
-                enqueuePacket(ep, NULL, 0);
-                return true;
-            }
+    uint32_t ts = millis();
+    while (_endpointBuffers[ep].count > 0) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
+        if (_inIsr) {
+            continueTransmit(ep);
         }
     }
 
     while (remain > 0) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            _manager->countTimeout(ep);
+            return false;
+        }
         if (canEnqueuePacket(ep)) {
             uint32_t toSend = min(remain, psize);
             enqueuePacket(ep, &data[pos], toSend);
@@ -334,23 +758,14 @@ bool USBHS::sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
 }
 
 void USBHS::handleInterrupt() {
+    uint32_t start = USBManager::profileStart();
+    _inIsr = true;
+
     uint32_t csr0 = USBCSR0;
     bool isEP0IF = (csr0 & (1<<16)) ? true : false;
-    bool isEP1TXIF = (csr0 & (1<<17)) ? true : false;
-    bool isEP2TXIF = (csr0 & (1<<18)) ? true : false;
-    bool isEP3TXIF = (csr0 & (1<<19)) ? true : false;
-    bool isEP4TXIF = (csr0 & (1<<20)) ? true : false;
-    bool isEP5TXIF = (csr0 & (1<<21)) ? true : false;
-    bool isEP6TXIF = (csr0 & (1<<22)) ? true : false;
-    bool isEP7TXIF = (csr0 & (1<<23)) ? true : false;
+    uint32_t txFlags = (csr0 >> 16) & 0xFE;    // EP1TXIF-EP7TXIF
     uint32_t csr1 = USBCSR1;
-    bool isEP1RXIF = (csr1 & (1 << 1)) ? true : false;
-    bool isEP2RXIF = (csr1 & (1 << 2)) ? true : false;
-    bool isEP3RXIF = (csr1 & (1 << 3)) ? true : false;
-    bool isEP4RXIF = (csr1 & (1 << 4)) ? true : false;
-    bool isEP5RXIF = (csr1 & (1 << 5)) ? true : false;
-    bool isEP6RXIF = (csr1 & (1 << 6)) ? true : false;
-    bool isEP7RXIF = (csr1 & (1 << 7)) ? true : false;
+    uint32_t rxFlags = csr1 & 0xFE;             // EP1RXIF-EP7RXIF
     uint32_t csr2 = USBCSR2;
     bool __attribute__((unused)) isRESUMEIF = (csr2 & (1 << 17)) ? true : false;
     bool isRESETIF = (csr2 & (1 << 18)) ? true : false;
@@ -361,20 +776,8 @@ void USBHS::handleInterrupt() {
     bool __attribute__((unused)) isVBUSERRIF = (csr2 & (1 << 23)) ? true : false;
 #ifdef DEBUG
     if (isEP0IF) Serial.println("EP0IF");
-    if (isEP1TXIF) Serial.println("EP1TXIF");
-    if (isEP2TXIF) Serial.println("EP2TXIF");
-    if (isEP3TXIF) Serial.println("EP3TXIF");
-    if (isEP4TXIF) Serial.println("EP4TXIF");
-    if (isEP5TXIF) Serial.println("EP5TXIF");
-    if (isEP6TXIF) Serial.println("EP6TXIF");
-    if (isEP7TXIF) Serial.println("EP7TXIF");
-    if (isEP1RXIF) Serial.println("EP1RXIF");
-    if (isEP2RXIF) Serial.println("EP2RXIF");
-    if (isEP3RXIF) Serial.println("EP3RXIF");
-    if (isEP4RXIF) Serial.println("EP4RXIF");
-    if (isEP5RXIF) Serial.println("EP5RXIF");
-    if (isEP6RXIF) Serial.println("EP6RXIF");
-    if (isEP7RXIF) Serial.println("EP7RXIF");
+    if (txFlags) { Serial.print("EPTXIF "); Serial.println(txFlags, BIN); }
+    if (rxFlags) { Serial.print("EPRXIF "); Serial.println(rxFlags, BIN); }
     if (isRESUMEIF) Serial.println("RESUMEIF");
     if (isRESETIF) Serial.println("RESETIF");
     if (isSOFIF) Serial.println("SOFIF");
@@ -383,208 +786,191 @@ void USBHS::handleInterrupt() {
     if (isVBUSERRIF) Serial.println("VBUSERRIF");
 #endif
     if (isRESETIF) {
+        uint32_t resetStart = USBManager::profileStart();
+        _highSpeed = USBCSR0bits.HSMODE;
+
+        // Anything the DMA controller was moving belongs to the old session.
+        // Stop it before the manager can give the buffers out again.
+        for (uint8_t ch = 0; ch < USB_DMA_CHANNELS; ch++) {
+            DMA_C(ch) = 0;
+        }
+        (void)USBDMAINT;    // Drop any completions not handled yet
+        _dmaBusy = 0;
+        _dmaRxBusy = 0;
+        _rxWaiting = 0;
+        _rxHeld = 0;
+        for (uint8_t ep = 0; ep < 8; ep++) {
+            abortTransfers(ep);
+        }
+
+        if (_manager) _manager->onBusReset();
+
         addEndpoint(0, EP_IN, EP_CTL, 64, _ctlRxA, _ctlRxB);
         addEndpoint(0, EP_OUT, EP_CTL, 64, _ctlTxA, _ctlTxB);
+        if (_manager) _manager->profileEnd(USB_PROF_RESET, 0, resetStart);
     }
 
-    volatile uint8_t *fifo;
     if (isEP0IF) {
+        if (USBE0CSR0bits.STALLED) {
+            USBE0CSR0bits.STALLED = 0;
+        }
         if (USBE0CSR0bits.RXRDY) {
 
             uint32_t pktlen = USBE0CSR2bits.RXCNT;
 
-            fifo = (uint8_t *)&USBFIFO0;
-            for (uint32_t i = 0; i < pktlen; i++) {
-                _endpointBuffers[0].rx[0][i] = *(fifo + (i & 3));
-            }
+            readFifo(0, _endpointBuffers[0].rx[0], pktlen);
 
             USBE0CSR0bits.RXRDYC = 1;
 
-            if (_manager) _manager->onSetupPacket(0, _endpointBuffers[0].rx[0], pktlen);
-            USBE0CSR0bits.SETENDC = 1;
+            // EP0 doesn't say which packets are SETUP and which are the
+            // data stage of a control write; the manager keeps track.
+            if (_manager && _manager->isControlOutStage()) {
+                _manager->countOut(0, pktlen);
+                _manager->onOutPacket(0, _endpointBuffers[0].rx[0], pktlen);
+            } else {
+                // A new request ends anything the last one still had to send
+                abortTransfers(0);
+                if (_manager) _manager->onSetupPacket(0, _endpointBuffers[0].rx[0], pktlen);
+                USBE0CSR0bits.SETENDC = 1;
+            }
         } else {
+            continueTransmit(0);
             if (_manager) _manager->onInPacket(0, _endpointBuffers[0].tx[0], _endpointBuffers[0].size);
         }
     }
 
-    if (isEP1RXIF) {
+    // Only the endpoints with a flag set are visited. The handlers select
+    // the endpoint's registers and leave them selected; the index is put
+    // back once at the end.
+    if (rxFlags || txFlags) {
         uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 1;
 
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
-
-        fifo = (uint8_t *)&USBFIFO1;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[1].rx[0][i] = *(fifo + (i & 3));
+        while (rxFlags) {
+            uint8_t ep = 31 - __builtin_clz(rxFlags);
+            rxFlags &= ~(1 << ep);
+            receivePacket(ep);
         }
 
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(1, _endpointBuffers[1].rx[0], pktlen);
-
-        USBCSR3bits.ENDPOINT = oep;
-    }
-
-    if (isEP2RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 2;
-
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
-
-        fifo = (uint8_t *)&USBFIFO2;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[2].rx[0][i] = *(fifo + (i & 3));
+        while (txFlags) {
+            uint8_t ep = 31 - __builtin_clz(txFlags);
+            txFlags &= ~(1 << ep);
+            transmitComplete(ep);
         }
 
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(2, _endpointBuffers[2].rx[0], pktlen);
-
         USBCSR3bits.ENDPOINT = oep;
     }
 
-    if (isEP3RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 3;
-
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
+    clearIntFlag(_USB_VECTOR);
+    _inIsr = false;
+    if (_manager) _manager->profileEnd(USB_PROF_ISR, 0, start);
+}
 
-        fifo = (uint8_t *)&USBFIFO3;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[3].rx[0][i] = *(fifo + (i & 3));
-        }
-        
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(3, _endpointBuffers[3].rx[0], pktlen);
+// Take a packet from an OUT endpoint's FIFO and pass it on. Large packets
+// are left to the DMA controller and passed on from its interrupt. Leaves
+// the endpoint selected.
+void USBHS::receivePacket(uint8_t ep) {
+    USBCSR3bits.ENDPOINT = ep;
 
-        USBCSR3bits.ENDPOINT = oep;
+    // The endpoint's buffer still holds a packet the DMA controller is
+    // filling or that hasn't been passed on yet, or the endpoint is halted.
+    // Leave this one in the FIFO (RXPKTRDY set, so the host is NAKed) until
+    // that has been done.
+    if ((_dmaRxBusy | _rxHeld) & (1 << ep)) {
+        _rxWaiting |= (1 << ep);
+        return;
     }
 
-    if (isEP4RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 4;
+    uint32_t pktlen = USBIENCSR2bits.RXCNT;
+    uint8_t *buffer = _endpointBuffers[ep].rx[0];
 
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
+    if (!startDma(ep, false, buffer, pktlen)) {
+        readFifo(ep, buffer, pktlen);
 
-        fifo = (uint8_t *)&USBFIFO4;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[4].rx[0][i] = *(fifo + (i & 3));
-        }
-        
         USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(4, _endpointBuffers[4].rx[0], pktlen);
-
-        USBCSR3bits.ENDPOINT = oep;
+        if (_manager) _manager->countOut(ep, pktlen);
+        if (_manager) _manager->onOutPacket(ep, buffer, pktlen);
     }
+}
 
-    if (isEP5RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 5;
-
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
+// An IN endpoint's packet has gone. Start the next one, if any, and tell
+// the manager. Leaves the endpoint selected.
+void USBHS::transmitComplete(uint8_t ep) {
+    USBCSR3bits.ENDPOINT = ep;
+    USBIENCSR0bits.MODE = 0;
+    continueTransmit(ep);
+    if (_manager) _manager->onInPacket(ep, _endpointBuffers[ep].tx[0], _endpointBuffers[ep].size);
+}
 
-        fifo = (uint8_t *)&USBFIFO5;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[5].rx[0][i] = *(fifo + (i & 3));
-        }
-        
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(5, _endpointBuffers[5].rx[0], pktlen);
+// A DMA channel has finished. A transmitted packet is now in the FIFO and
+// can be sent; a received one is in memory and can be passed on.
+void USBHS::handleDmaInterrupt() {
+    uint32_t start = USBManager::profileStart();
+    _inIsr = true;
 
-        USBCSR3bits.ENDPOINT = oep;
-    }
+    uint32_t flags = USBDMAINT;     // Reading clears the flags
+    uint8_t oep = USBCSR3bits.ENDPOINT;
 
-    if (isEP6RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 6;
+    for (uint8_t ch = 0; ch < USB_DMA_CHANNELS; ch++) {
+        if (!(flags & (1 << ch))) continue;
 
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
+        struct dmaChannel *d = &_dma[ch];
+        bool error = (DMA_C(ch) & DMA_ERROR) != 0;
+        DMA_C(ch) = 0;
+        USBCSR3bits.ENDPOINT = d->ep;
 
-        fifo = (uint8_t *)&USBFIFO6;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[6].rx[0][i] = *(fifo + (i & 3));
+        if (error && _manager) {
+            _manager->countErrors(1 << USB_ERR_DMA);
         }
-        
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(6, _endpointBuffers[6].rx[0], pktlen);
 
-        USBCSR3bits.ENDPOINT = oep;
-    }
-
-    if (isEP7RXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 7;
-
-        uint32_t pktlen = USBIENCSR2bits.RXCNT;
-
-        fifo = (uint8_t *)&USBFIFO7;
-        for (uint32_t i = 0; i < pktlen; i++) {
-            _endpointBuffers[7].rx[0][i] = *(fifo + (i & 3));
+        uint32_t size = _endpointBuffers[d->ep].size;
+
+        if (d->tx) {
+            _dmaBusy &= ~(1 << d->ep);
+            USBIENCSR0bits.DMAREQEN = 0;
+            if (error) {
+                // Send the packet the slow way instead. A burst can't be
+                // picked up part way through, so it is dropped.
+                USBIENCSR0bits.FLUSH = 1;
+                if (d->length <= size) {
+                    writePacket(d->ep, d->buffer, d->length);
+                }
+            } else if (!(_autoTx & (1 << d->ep)) || (d->length % size)) {
+                // AUTOSET has already sent any full packets
+                USBIENCSR0bits.MODE = 1;
+                USBIENCSR0bits.TXPKTRDY = 1;
+            }
+            // A burst is all in the FIFO now, so its transfer is done with
+            if (d->length > size) {
+                continueTransmit(d->ep);
+            }
+        } else {
+            // AUTOCLR has already freed a full packet, and another may have
+            // arrived in its place
+            if (!(_autoRx & (1 << d->ep)) || (d->length < size)) {
+                USBIENCSR1bits.RXPKTRDY = 0;
+            }
+            if (!error) {
+                cacheInvalidate(d->buffer, size);
+                if (_manager) _manager->countOut(d->ep, d->length);
+                if (_manager) _manager->onOutPacket(d->ep, d->buffer, d->length);
+            }
+            _dmaRxBusy &= ~(1 << d->ep);
+
+            // Fetch the packet that arrived while the buffer was in use
+            if (_rxWaiting & (1 << d->ep)) {
+                _rxWaiting &= ~(1 << d->ep);
+                USBCSR3bits.ENDPOINT = d->ep;
+                if (USBIENCSR1bits.RXPKTRDY) {
+                    receivePacket(d->ep);
+                }
+            }
         }
-        
-        USBIENCSR1bits.RXPKTRDY = 0;
-        if (_manager) _manager->onOutPacket(7, _endpointBuffers[7].tx[0], pktlen);
-
-        USBCSR3bits.ENDPOINT = oep;
     }
 
-    if (isEP1TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 1;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(1, _endpointBuffers[1].tx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP2TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 2;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(2, _endpointBuffers[2].tx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP3TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 3;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(3, _endpointBuffers[3].rx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP4TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 4;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(4, _endpointBuffers[4].rx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP5TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 5;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(5, _endpointBuffers[5].rx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP6TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 6;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(6, _endpointBuffers[6].rx[0], _endpointBuffers[3].size);
-    }
-        
-    if (isEP7TXIF) {
-        uint8_t oep = USBCSR3bits.ENDPOINT;
-        USBCSR3bits.ENDPOINT = 7;
-        USBIENCSR0bits.MODE = 0;
-        USBCSR3bits.ENDPOINT = oep;
-        if (_manager) _manager->onInPacket(7, _endpointBuffers[7].rx[0], _endpointBuffers[3].size);
-    }
-        
-
-
-    clearIntFlag(_USB_VECTOR);
+    USBCSR3bits.ENDPOINT = oep;
+    clearIntFlag(_USB_DMA_VECTOR);
+    _inIsr = false;
+    if (_manager) _manager->profileEnd(USB_PROF_ISR, 0, start);
 }
 
 bool USBHS::setAddress(uint8_t address) {
@@ -592,24 +978,67 @@ bool USBHS::setAddress(uint8_t address) {
 	return true;
 }
 
+// Flow control: packets arriving on a halted endpoint are left in the FIFO
+// with RXPKTRDY set, so the host is NAKed until the endpoint is resumed.
 void USBHS::haltEndpoint(uint8_t ep) {
+    _rxHeld |= (1 << (ep & 0x0F));
+}
+
+void USBHS::resumeEndpoint(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+    uint32_t s = disableInterrupts();
+    _rxHeld &= ~(1 << id);
+    if ((_rxWaiting & (1 << id)) && !(_dmaRxBusy & (1 << id))) {
+        uint8_t oep = USBCSR3bits.ENDPOINT;
+        _rxWaiting &= ~(1 << id);
+        USBCSR3bits.ENDPOINT = id;
+        if (USBIENCSR1bits.RXPKTRDY) {
+            receivePacket(id);
+        }
+        USBCSR3bits.ENDPOINT = oep;
+    }
+    restoreInterrupts(s);
+}
+
+// Protocol stall requested by the host. EP0 stalls the current control
+// request; the core clears that by itself when the next SETUP arrives.
+void USBHS::stallEndpoint(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+
+    if (id == 0) {
+        USBE0CSR0bits.STALL = 1;
+        return;
+    }
+
     uint8_t oep = USBCSR3bits.ENDPOINT;
-    USBCSR3bits.ENDPOINT = ep;
-    if (!USBIENCSR0bits.SENDSTALL) {
+    USBCSR3bits.ENDPOINT = id;
+    if (ep & 0x80) {
         USBIENCSR0bits.SENDSTALL = 1;
+    } else {
+        USBIENCSR1bits.SENDSTALL = 1;
     }
     USBCSR3bits.ENDPOINT = oep;
 }
 
-void USBHS::resumeEndpoint(uint8_t ep) {
+void USBHS::clearStall(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+
+    if (id == 0) {
+        return;
+    }
+
     uint8_t oep = USBCSR3bits.ENDPOINT;
-    USBCSR3bits.ENDPOINT = ep;
-    if (USBIENCSR0bits.SENDSTALL) {
+    USBCSR3bits.ENDPOINT = id;
+    if (ep & 0x80) {
         USBIENCSR0bits.SENDSTALL = 0;
+        USBIENCSR0bits.SENTSTALL = 0;
         USBIENCSR0bits.CLRDT = 1;
+    } else {
+        USBIENCSR1bits.SENDSTALL = 0;
+        USBIENCSR1bits.SENTSTALL = 0;
+        USBIENCSR1bits.CLRDT = 1;
     }
     USBCSR3bits.ENDPOINT = oep;
 }
 
-
 #endif
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2017, Majenko Technologies
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of Majenko Technologies nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <USB.h>
+
+/*
+ * A fixed block memory pool. Free blocks are kept on a singly linked list
+ * threaded through the blocks themselves, so allocating and releasing are
+ * both constant time and the pool never fragments. The list is only ever
+ * touched with interrupts disabled, so the pool can be used from the USB
+ * interrupt as well as from normal code.
+ */
+
+void USBPool::init(uint8_t *storage, uint32_t blockSize, uint32_t blocks) {
+    _storage = storage;
+    _blockSize = blockSize;
+    _blocks = blocks;
+    _free = NULL;
+    _inUse = 0;
+    _highWater = 0;
+    _failures = 0;
+
+    for (uint32_t i = blocks; i > 0; i--) {
+        void **block = (void **)(storage + ((i - 1) * blockSize));
+        *block = _free;
+        _free = block;
+    }
+}
+
+void *USBPool::allocate() {
+    uint32_t s = disableInterrupts();
+    void **block = (void **)_free;
+    if (block == NULL) {
+        restoreInterrupts(s);
+        return NULL;
+    }
+    _free = *block;
+    _inUse++;
+    if (_inUse > _highWater) {
+        _highWater = _inUse;
+    }
+    restoreInterrupts(s);
+    return block;
+}
+
+// Note a request this pool was the first choice for that no pool could
+// satisfy. A pool that ran dry but had a bigger one to fall back on
+// doesn't count it.
+void USBPool::countFailure() {
+    uint32_t s = disableInterrupts();
+    _failures++;
+    restoreInterrupts(s);
+}
+
+void USBPool::release(void *block) {
+    uint32_t s = disableInterrupts();
+    *(void **)block = _free;
+    _free = block;
+    _inUse--;
+    restoreInterrupts(s);
+}
+
+void USBPool::getStats(struct USBPoolStats *stats) {
+    uint32_t s = disableInterrupts();
+    stats->blockSize = _blockSize;
+    stats->blocks = _blocks;
+    stats->inUse = _inUse;
+    stats->highWater = _highWater;
+    stats->failures = _failures;
+    restoreInterrupts(s);
+}
+
+void USBManager::initPools() {
+    _pools[USB_POOL_TINY].init(_poolTiny, USB_POOL_TINY_SIZE, USB_POOL_TINY_COUNT);
+    _pools[USB_POOL_SMALL].init(_poolSmall, USB_POOL_SMALL_SIZE, USB_POOL_SMALL_COUNT);
+    _pools[USB_POOL_LARGE].init(_poolLarge, USB_POOL_LARGE_SIZE, USB_POOL_LARGE_COUNT);
+    _allocationFailures = 0;
+}
+
+// Allocate a block of at least len bytes from the smallest pool that can
+// hold it, moving up to the bigger pools if that one is empty. Returns NULL
+// if nothing fits.
+void *USBManager::allocateBuffer(uint32_t len) {
+    int first = -1;
+    for (int i = 0; i < USB_POOLS; i++) {
+        if (_pools[i].getBlockSize() >= len) {
+            if (first < 0) {
+                first = i;
+            }
+            void *buf = _pools[i].allocate();
+            if (buf != NULL) {
+                return buf;
+            }
+        }
+    }
+    if (first >= 0) {
+        _pools[first].countFailure();
+    }
+    _allocationFailures++;
+#ifdef USB_STATISTICS
+    _stats.allocationFailures++;
+#endif
+    return NULL;
+}
+
+void USBManager::releaseBuffer(void *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    for (int i = 0; i < USB_POOLS; i++) {
+        if (_pools[i].owns(buf)) {
+            _pools[i].release(buf);
+            return;
+        }
+    }
+}
+
+bool USBManager::getPoolStats(uint8_t pool, struct USBPoolStats *stats) {
+    if (pool >= USB_POOLS) {
+        return false;
+    }
+    _pools[pool].getStats(stats);
+    return true;
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2017, Majenko Technologies
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of Majenko Technologies nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if !defined(__PIC32MX__) && !defined(__PIC32MZ__)
+
+#include <USB.h>
+
+/*
+ * A simulated driver for building and testing the stack on a PC. Packets
+ * the device sends are held in a small FIFO per endpoint until the host
+ * side collects them with hostIn(); packets the host sends with hostOut()
+ * and hostSetup() go straight to the manager, just as the interrupt
+ * handler of a real driver would pass them on. Everything runs in the
+ * caller's thread, so with deferred events enabled the host has to call
+ * USBManager::task() itself (controlTransfer() does so while it waits).
+ */
+
+USBSimDriver::USBSimDriver(bool highSpeed) {
+    _manager = NULL;
+    _enabled = false;
+    _highSpeed = highSpeed;
+    _address = 0;
+    memset(_ep, 0, sizeof(_ep));
+}
+
+bool USBSimDriver::enableUSB() {
+    _enabled = true;
+    addEndpoint(0, EP_IN, EP_CTL, 64, _ctlRx, _ctlRx);
+    addEndpoint(0, EP_OUT, EP_CTL, 64, _ctlTx, _ctlTx);
+    return true;
+}
+
+bool USBSimDriver::disableUSB() {
+    _enabled = false;
+    return true;
+}
+
+bool USBSimDriver::addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t __attribute__((unused)) *b) {
+    if (id > 15) return false;
+    if (size > sizeof(_ep[id].fifo[0].data)) return false;
+    _ep[id].type = type;
+    if (direction == EP_IN) {
+        _ep[id].rxSize = size;
+        _ep[id].rx = a;
+    } else {
+        _ep[id].txSize = size;
+    }
+    return true;
+}
+
+// Throw away anything still waiting for the host on an endpoint
+void USBSimDriver::flush(uint8_t ep) {
+    _ep[ep].head = 0;
+    _ep[ep].count = 0;
+}
+
+bool USBSimDriver::canEnqueuePacket(uint8_t ep) {
+    if (ep > 15) return false;
+    return _ep[ep].count < USB_SIM_FIFO_PACKETS;
+}
+
+// A high-bandwidth endpoint's transactions reach the host as one packet,
+// as the USBHS FIFO hands them over.
+bool USBSimDriver::addPeriodicEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t transactions, uint8_t *a, uint8_t *b) {
+    if ((transactions < 1) || (transactions > 3)) return false;
+    if ((transactions > 1) && !_highSpeed) return false;
+    return addEndpoint(id, direction, type, size * transactions, a, b);
+}
+
+bool USBSimDriver::enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) {
+    if (ep > 15) return false;
+    struct simEndpoint *e = &_ep[ep];
+    if ((e->txSize == 0) || (e->count >= USB_SIM_FIFO_PACKETS)) {
+        return false;
+    }
+
+    if (_manager) _manager->traceEvent(USB_TRACE_IN, ep | 0x80, data, len);
+
+    struct simPacket *p = &e->fifo[(e->head + e->count) % USB_SIM_FIFO_PACKETS];
+    p->length = min(len, e->txSize);
+    if (p->length > 0) memcpy(p->data, data, p->length);
+    p->ready = millis() + e->delay;
+    e->count++;
+    return true;
+}
+
+// Split the buffer into packets, waiting for room in the FIFO as a real
+// driver waits for its buffers. Nothing empties the FIFO while we wait, so
+// a host that isn't reading gets a timeout, as it would on the hardware.
+bool USBSimDriver::sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
+    if (ep > 15) return false;
+    uint32_t pos = 0;
+    uint32_t ts = millis();
+
+    do {
+        while (!canEnqueuePacket(ep)) {
+            if (millis() - ts > USB_TX_TIMEOUT) {
+                if (_manager) _manager->countTimeout(ep);
+                return false;
+            }
+        }
+        uint32_t toSend = min(_ep[ep].txSize, len - pos);
+        if (!enqueuePacket(ep, data + pos, toSend)) {
+            return false;
+        }
+        pos += toSend;
+    } while (pos < len);
+    return true;
+}
+
+bool USBSimDriver::setAddress(uint8_t address) {
+    _address = address;
+    return true;
+}
+
+void USBSimDriver::haltEndpoint(uint8_t ep) {
+    _ep[ep & 0x0F].halted = true;
+}
+
+void USBSimDriver::resumeEndpoint(uint8_t ep) {
+    _ep[ep & 0x0F].halted = false;
+}
+
+void USBSimDriver::stallEndpoint(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+    if ((id == 0) || (ep & 0x80)) {
+        _ep[id].stallIn = true;
+    }
+    if ((id == 0) || !(ep & 0x80)) {
+        _ep[id].stallOut = true;
+    }
+}
+
+void USBSimDriver::clearStall(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+    if ((id == 0) || (ep & 0x80)) {
+        _ep[id].stallIn = false;
+    }
+    if ((id == 0) || !(ep & 0x80)) {
+        _ep[id].stallOut = false;
+    }
+}
+
+bool USBSimDriver::isStalled(uint8_t ep) {
+    uint8_t id = ep & 0x0F;
+    return (ep & 0x80) ? _ep[id].stallIn : _ep[id].stallOut;
+}
+
+void USBSimDriver::injectNak(uint8_t ep, uint32_t count) {
+    _ep[ep & 0x0F].naks = count;
+}
+
+void USBSimDriver::setDelay(uint8_t ep, uint32_t ms) {
+    _ep[ep & 0x0F].delay = ms;
+}
+
+// The host drives a bus reset. Configured endpoints stay as they are, as
+// they do on the hardware; anything in flight is lost.
+void USBSimDriver::hostReset() {
+    for (int i = 0; i < 16; i++) {
+        flush(i);
+        _ep[i].naks = 0;
+        _ep[i].stallIn = false;
+        _ep[i].stallOut = false;
+        _ep[i].halted = false;
+    }
+    _address = 0;
+    if (_manager) _manager->onBusReset();
+}
+
+void USBSimDriver::hostSetup(const uint8_t *setup) {
+    // A SETUP is always accepted and ends any stall or stale data on EP0
+    clearStall(0);
+    flush(0);
+    memcpy(_ctlRx, setup, 8);
+    if (_manager) _manager->onSetupPacket(0, _ctlRx, 8);
+}
+
+// Send one OUT packet. Returns the number of bytes the device accepted,
+// USB_SIM_NAK or USB_SIM_STALL.
+int USBSimDriver::hostOut(uint8_t ep, const uint8_t *data, uint32_t len) {
+    if (ep > 15) return USB_SIM_STALL;
+    struct simEndpoint *e = &_ep[ep];
+
+    if ((e->rxSize == 0) || e->stallOut) {
+        return USB_SIM_STALL;
+    }
+    if (e->naks > 0) {
+        e->naks--;
+        return USB_SIM_NAK;
+    }
+    if (e->halted) {
+        return USB_SIM_NAK;
+    }
+
+    len = min(len, e->rxSize);
+    if (len > 0) memcpy(e->rx, data, len);
+    if (_manager) {
+        _manager->countOut(ep, len);
+        _manager->onOutPacket(ep, e->rx, len);
+    }
+    return len;
+}
+
+// Collect one IN packet. Returns its length, USB_SIM_NAK if there is
+// nothing (yet) to collect, or USB_SIM_STALL.
+int USBSimDriver::hostIn(uint8_t ep, uint8_t *data, uint32_t maxlen) {
+    if (ep > 15) return USB_SIM_STALL;
+    struct simEndpoint *e = &_ep[ep];
+
+    if ((e->txSize == 0) || e->stallIn) {
+        return USB_SIM_STALL;
+    }
+    if (e->naks > 0) {
+        e->naks--;
+        return USB_SIM_NAK;
+    }
+    if (e->count == 0) {
+        return USB_SIM_NAK;
+    }
+
+    struct simPacket *p = &e->fifo[e->head];
+    if ((int32_t)(millis() - p->ready) < 0) {
+        return USB_SIM_NAK;
+    }
+
+    uint32_t len = min(p->length, maxlen);
+    if (len > 0) memcpy(data, p->data, len);
+    e->head = (e->head + 1) % USB_SIM_FIFO_PACKETS;
+    e->count--;
+
+    if (_manager) {
+        _manager->countIn(ep, len);
+        _manager->onInPacket(ep, p->data, len);
+    }
+    return len;
+}
+
+// Retry a transaction through NAKs, running the manager's deferred events
+// between attempts, until it succeeds, stalls or USB_TX_TIMEOUT passes.
+int USBSimDriver::waitIn(uint8_t ep, uint8_t *data, uint32_t maxlen) {
+    uint32_t ts = millis();
+    int r;
+    while ((r = hostIn(ep, data, maxlen)) == USB_SIM_NAK) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            return USB_SIM_TIMEOUT;
+        }
+        if (_manager) _manager->task();
+    }
+    return r;
+}
+
+int USBSimDriver::waitOut(uint8_t ep, const uint8_t *data, uint32_t len) {
+    uint32_t ts = millis();
+    int r;
+    while ((r = hostOut(ep, data, len)) == USB_SIM_NAK) {
+        if (millis() - ts > USB_TX_TIMEOUT) {
+            return USB_SIM_TIMEOUT;
+        }
+        if (_manager) _manager->task();
+    }
+    return r;
+}
+
+// Run a whole control transfer on EP0: SETUP, any data stage and the
+// status stage. For device-to-host requests up to maxlen bytes are read
+// into data; for host-to-device requests wLength bytes are sent from it.
+// Returns the length of the data stage or a negative USB_SIM_* result.
+int USBSimDriver::controlTransfer(const uint8_t *setup, uint8_t *data, uint32_t maxlen) {
+    uint32_t wLength = (setup[7] << 8) | setup[6];
+    uint32_t pos = 0;
+    uint8_t zlp[1];
+    int r;
+
+    hostSetup(setup);
+
+    if (setup[0] & 0x80) {
+        // Read until a short packet or wLength bytes arrive
+        uint32_t want = min(wLength, maxlen);
+        while (pos < want) {
+            r = waitIn(0, data + pos, want - pos);
+            if (r < 0) return r;
+            pos += r;
+            if ((uint32_t)r < _ep[0].txSize) break;
+        }
+        r = waitOut(0, zlp, 0);
+    } else {
+        while (pos < wLength) {
+            uint32_t toSend = min(_ep[0].rxSize, wLength - pos);
+            r = waitOut(0, data + pos, toSend);
+            if (r < 0) return r;
+            pos += toSend;
+        }
+        r = waitIn(0, zlp, 0);
+    }
+    return (r < 0) ? r : (int)pos;
+}
+
+#endif
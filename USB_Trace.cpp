@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2017, Majenko Technologies
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of Majenko Technologies nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <USB.h>
+
+/*
+ * Event tracing. Each event is written into a fixed ring of
+ * USB_TRACE_SIZE entries, oldest first out. A slot is claimed with a
+ * single atomic increment, so events can be recorded from the interrupt
+ * and from normal code alike without a lock. dumpTrace() turns the ring
+ * into a pcap file with the Linux usbmon link type so it can be opened
+ * in Wireshark.
+ */
+
+#ifdef USB_TRACE
+
+#if (USB_TRACE_SIZE & (USB_TRACE_SIZE - 1)) != 0
+# error USB_TRACE_SIZE must be a power of two
+#endif
+
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED 220
+#define PCAP_RECORD_HEADER 16
+#define USBMON_HEADER 64
+
+// Errors reported in the usbmon status field, as Linux would
+#define USBMON_EPIPE -32
+#define USBMON_ECONNRESET -104
+#define USBMON_ETIMEDOUT -110
+
+void USBManager::traceEvent(uint8_t type, uint8_t ep, const uint8_t *data, uint32_t len) {
+    uint32_t slot = __sync_fetch_and_add(&_traceHead, 1);
+    struct USBTraceEvent *ev = &_trace[slot & (USB_TRACE_SIZE - 1)];
+
+    ev->time = micros();
+    ev->type = type;
+    ev->ep = ep;
+    ev->address = _address;
+    ev->length = len;
+    ev->captured = 0;
+    if (data != NULL) {
+        ev->captured = min(len, USB_TRACE_DATA);
+        memcpy(ev->data, data, ev->captured);
+    }
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// usbmon transfer types, indexed by EP_CTL, EP_INT, EP_BLK, EP_ISO
+static const uint8_t usbmonXferType[4] = { 2, 1, 3, 0 };
+
+// Write the pcap file header and as many whole events as fit in limit bytes.
+static size_t writeTrace(Print &out, size_t limit, const struct USBTraceEvent *trace, volatile uint32_t *head, const uint8_t *epType) {
+    uint8_t rec[PCAP_RECORD_HEADER + USBMON_HEADER + USB_TRACE_DATA];
+    size_t written = 0;
+
+    if (limit < 24) {
+        return 0;
+    }
+
+    put32(&rec[0], 0xa1b2c3d4);     // Magic
+    put16(&rec[4], 2);              // Version 2.4
+    put16(&rec[6], 4);
+    put32(&rec[8], 0);              // Time zone
+    put32(&rec[12], 0);             // Accuracy
+    put32(&rec[16], PCAP_RECORD_HEADER + USBMON_HEADER + USB_TRACE_DATA);  // Snap length
+    put32(&rec[20], PCAP_LINKTYPE_USB_LINUX_MMAPPED);
+    written += out.write(rec, 24);
+
+    uint32_t end = *head;
+    uint32_t start = (end > USB_TRACE_SIZE) ? end - USB_TRACE_SIZE : 0;
+
+    for (uint32_t i = start; i < end; i++) {
+        struct USBTraceEvent ev;
+        uint32_t s = disableInterrupts();
+        memcpy(&ev, &trace[i & (USB_TRACE_SIZE - 1)], sizeof(ev));
+        uint32_t now = *head;
+        restoreInterrupts(s);
+
+        // Overwritten by newer events since the dump started
+        if (now - i > USB_TRACE_SIZE) {
+            continue;
+        }
+
+        uint8_t capture = (ev.type == USB_TRACE_SETUP) ? 0 : ev.captured;
+        uint32_t size = PCAP_RECORD_HEADER + USBMON_HEADER + capture;
+        if (written + size > limit) {
+            break;
+        }
+
+        memset(rec, 0, sizeof(rec));
+        put32(&rec[0], ev.time / 1000000UL);
+        put32(&rec[4], ev.time % 1000000UL);
+        put32(&rec[8], USBMON_HEADER + capture);
+        put32(&rec[12], USBMON_HEADER + capture);
+
+        uint8_t *mon = &rec[PCAP_RECORD_HEADER];
+        int32_t status = 0;
+        uint8_t ep = ev.ep;
+
+        put32(&mon[0], i);                              // URB id
+        mon[8] = 'C';
+        mon[9] = usbmonXferType[epType[ep & 0x0F] & 3];
+        mon[11] = ev.address;
+        put16(&mon[12], 1);                             // Bus number
+        mon[14] = '-';                                  // No setup packet
+        mon[15] = 0;                                    // Data present
+
+        switch (ev.type) {
+            case USB_TRACE_SETUP:
+                // The request goes in the setup field, its direction in the endpoint
+                mon[8] = 'S';
+                mon[9] = 2;
+                mon[14] = 0;
+                mon[15] = '<';
+                if (ev.captured >= 8) {
+                    memcpy(&mon[40], ev.data, 8);
+                    ep = ev.data[0] & 0x80;
+                    ev.length = ev.data[6] | (ev.data[7] << 8);
+                }
+                break;
+            case USB_TRACE_OUT:
+                mon[8] = 'S';
+                break;
+            case USB_TRACE_RESET:
+                mon[8] = 'E';
+                mon[9] = 2;
+                status = USBMON_ECONNRESET;
+                break;
+            case USB_TRACE_STALL:
+                status = USBMON_EPIPE;
+                break;
+            case USB_TRACE_TIMEOUT:
+                mon[8] = 'E';
+                ep |= 0x80;
+                status = USBMON_ETIMEDOUT;
+                break;
+        }
+
+        mon[10] = ep;
+        put32(&mon[16], ev.time / 1000000UL);          // Seconds (low word of 64)
+        put32(&mon[24], ev.time % 1000000UL);
+        put32(&mon[28], (uint32_t)status);
+        put32(&mon[32], ev.length);
+        put32(&mon[36], capture);
+        memcpy(&mon[USBMON_HEADER], ev.data, capture);
+
+        written += out.write(rec, size);
+    }
+    return written;
+}
+
+// Print into a plain buffer.
+class USBTraceBuffer : public Print {
+    private:
+        uint8_t *_buf;
+        size_t _len;
+        size_t _pos;
+
+    public:
+        USBTraceBuffer(uint8_t *buf, size_t len) : _buf(buf), _len(len), _pos(0) {}
+        size_t write(uint8_t b) {
+            if (_pos >= _len) return 0;
+            _buf[_pos++] = b;
+            return 1;
+        }
+        size_t write(const uint8_t *b, size_t l) {
+            size_t n = min(l, _len - _pos);
+            memcpy(&_buf[_pos], b, n);
+            _pos += n;
+            return n;
+        }
+};
+
+size_t USBManager::dumpTrace(Print &out) {
+    return writeTrace(out, (size_t)-1, _trace, &_traceHead, _epType);
+}
+
+size_t USBManager::dumpTrace(uint8_t *buf, size_t len) {
+    USBTraceBuffer out(buf, len);
+    return writeTrace(out, len, _trace, &_traceHead, _epType);
+}
+
+void USBManager::clearTrace() {
+    _traceHead = 0;
+}
+
+#else
+
+size_t USBManager::dumpTrace(Print &out) {
+    return 0;
+}
+
+size_t USBManager::dumpTrace(uint8_t *buf, size_t len) {
+    return 0;
+}
+
+void USBManager::clearTrace() {
+}
+
+#endif
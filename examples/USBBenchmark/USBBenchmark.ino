@@ -0,0 +1,294 @@
+#include <USB.h>
+
+// Benchmarks for the USB stack's internal paths. A null driver stands in for
+// the hardware so the manager and devices can be driven directly without a
+// host attached. Results are printed on Serial as CSV lines:
+//
+//     test,parameter,value,unit
+//
+// The class benchmarks measure how fast each device hands packets to the
+// driver, so they show the cost of the stack itself rather than of the bus.
+// extras/host has the same benchmarks run against a simulated host.
+
+#define BENCH_ITERATIONS 1000
+#define BENCH_MAX_DEVICES 12
+#define BENCH_BYTES 65536
+
+// The core timer ticks at half the CPU clock
+#define TICKS_PER_SECOND (F_CPU / 2)
+
+// A driver that accepts everything and sends nothing.
+class NullDriver : public USBDriver {
+    public:
+        bool enableUSB() { return true; }
+        bool disableUSB() { return true; }
+        bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b) { return true; }
+        bool enqueuePacket(uint8_t ep, const uint8_t *data, uint32_t len) { return true; }
+        bool canEnqueuePacket(uint8_t ep) { return true; }
+        bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) { return true; }
+        bool setAddress(uint8_t address) { return true; }
+        bool isHighSpeed() { return false; }
+        void haltEndpoint(uint8_t ep) {}
+        void resumeEndpoint(uint8_t ep) {}
+};
+
+// A null driver that counts what it is given and, when asked, notes the time
+// the next packet arrives. It also notes the first bulk endpoint the device receives on, which is the CDC/ACM data
+// endpoint as that device is added first.
+class CountingDriver : public NullDriver {
+    public:
+        uint32_t packets;
+        uint32_t bytes;
+        uint32_t sendTime;
+        bool timing;
+        uint8_t bulkRx;
+
+        CountingDriver() : packets(0), bytes(0), sendTime(0), timing(false), bulkRx(0) {}
+
+        bool addEndpoint(uint8_t id, uint8_t direction, uint8_t type, uint32_t size, uint8_t *a, uint8_t *b) {
+            if ((type == EP_BLK) && (direction == EP_IN) && (bulkRx == 0)) {
+                bulkRx = id;
+            }
+            return true;
+        }
+        bool sendBuffer(uint8_t ep, const uint8_t *data, uint32_t len) {
+            if (timing) {
+                sendTime = readCoreTimer();
+                timing = false;
+            }
+            packets++;
+            bytes += len;
+            return true;
+        }
+        void restart() {
+            packets = 0;
+            bytes = 0;
+        }
+};
+
+// A device with a single endpoint that claims only its own packets.
+class BenchDevice : public USBDevice {
+    public:
+        uint8_t _ep;
+        uint16_t getDescriptorLength() { return 0; }
+        uint8_t getInterfaceCount() { return 0; }
+        bool getStringDescriptor(uint8_t idx, uint16_t maxlen) { return false; }
+        uint32_t populateConfigurationDescriptor(uint8_t *buf) { return 0; }
+        void initDevice(USBManager *manager) { _ep = manager->allocateEndpoint(); }
+        bool getDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        bool getReportDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        void configureEndpoints() {}
+        bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+        bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return ep == _ep; }
+        bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return ep == _ep; }
+};
+
+NullDriver nullDriver;
+USBManager USB(nullDriver, 0xDEAD, 0xBEEF);
+BenchDevice devices[BENCH_MAX_DEVICES];
+
+// A second, realistic composite device for the enumeration and class
+// benchmarks.
+CountingDriver enumDriver;
+USBManager EnumUSB(enumDriver, 0xDEAD, 0xBEEF, "Majenko Technologies", "USB Benchmark");
+CDCACM enumSerial;
+HID_Keyboard enumKeyboard;
+HID_Mouse enumMouse;
+HID_Joystick enumJoystick;
+Audio_MIDI enumMIDI;
+
+// The GET_DESCRIPTOR requests a Windows host makes while enumerating.
+static const uint8_t enumSequence[][8] = {
+    { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 },   // Device (64)
+    { 0x00, 0x05, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 },   // Set address
+    { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 },   // Device
+    { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xFF, 0x00 },   // Configuration (255)
+    { 0x80, 0x06, 0x03, 0x03, 0x09, 0x04, 0xFF, 0x00 },   // Serial
+    { 0x80, 0x06, 0x00, 0x03, 0x00, 0x00, 0xFF, 0x00 },   // Languages
+    { 0x80, 0x06, 0x02, 0x03, 0x09, 0x04, 0xFF, 0x00 },   // Product
+    { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 },   // Device
+    { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0x09, 0x00 },   // Configuration header
+    { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0xFF, 0x00 },   // Configuration
+    { 0x80, 0x06, 0x01, 0x03, 0x09, 0x04, 0xFF, 0x00 },   // Manufacturer
+    { 0x80, 0x06, 0x02, 0x03, 0x09, 0x04, 0xFF, 0x00 },   // Product
+    { 0x80, 0x06, 0x03, 0x03, 0x09, 0x04, 0xFF, 0x00 },   // Serial
+    { 0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 },   // Set configuration
+};
+
+// Raise DTR and RTS on the CDC/ACM port (interface 0) so it will send
+static const uint8_t lineState[8] = { 0x21, 0x22, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+uint8_t packet[64];
+
+void report(const char *test, uint32_t param, uint32_t value, const char *unit) {
+    Serial.print(test);
+    Serial.print(",");
+    Serial.print(param);
+    Serial.print(",");
+    Serial.print(value);
+    Serial.print(",");
+    Serial.println(unit);
+}
+
+// Compare scanning every device in turn (the old dispatch method) with the
+// manager's endpoint table as the number of devices grows. The packet is
+// always for the last device added, which is the worst case for a scan.
+void benchmarkDispatch() {
+    for (int n = 1; n <= BENCH_MAX_DEVICES; n++) {
+        USB.addDevice(devices[n - 1]);
+        uint8_t ep = devices[n - 1]._ep;
+
+        uint32_t start = readCoreTimer();
+        for (int i = 0; i < BENCH_ITERATIONS; i++) {
+            for (int d = 0; d < n; d++) {
+                USBDevice *dev = &devices[d];
+                if (dev->onOutPacket(ep, 0, packet, 64)) {
+                    break;
+                }
+            }
+        }
+        uint32_t scan = readCoreTimer() - start;
+
+        start = readCoreTimer();
+        for (int i = 0; i < BENCH_ITERATIONS; i++) {
+            USB.onOutPacket(ep, packet, 64);
+        }
+        uint32_t table = readCoreTimer() - start;
+
+        report("dispatch_scan", n, scan * 2 / BENCH_ITERATIONS, "cycles");
+        report("dispatch_table", n, table * 2 / BENCH_ITERATIONS, "cycles");
+    }
+}
+
+// Time the manager's handling of each enumeration request, and of the
+// whole sequence up to the device being configured. Run against two
+// versions of the stack to compare them.
+void benchmarkEnumeration() {
+    uint8_t setupPacket[8];
+    uint32_t total = 0;
+
+    for (uint32_t r = 0; r < sizeof(enumSequence) / sizeof(enumSequence[0]); r++) {
+        uint32_t start = readCoreTimer();
+        for (int i = 0; i < BENCH_ITERATIONS; i++) {
+            memcpy(setupPacket, enumSequence[r], 8);
+            EnumUSB.onSetupPacket(0, setupPacket, 8);
+        }
+        uint32_t elapsed = readCoreTimer() - start;
+        total += elapsed;
+        report("enumeration_request", r, elapsed * 2 / BENCH_ITERATIONS, "cycles");
+    }
+    report("enumeration_total", 0, total * 2 / BENCH_ITERATIONS, "cycles");
+}
+
+uint32_t perSecond(uint32_t count, uint32_t ticks) {
+    return (uint64_t)count * TICKS_PER_SECOND / ticks;
+}
+
+// How fast CDC/ACM can hand data to the driver, writing in chunks of each
+// size, and how fast the sketch can read what arrives a byte at a time.
+void benchmarkCDC() {
+    static const uint32_t writeSizes[] = { 1, 8, 64, 256, 1024 };
+    static const uint32_t readSizes[] = { 1, 8, 64 };
+    static uint8_t data[1024];
+    uint8_t setupPacket[8];
+
+    memcpy(setupPacket, lineState, 8);
+    EnumUSB.onSetupPacket(0, setupPacket, 8);
+
+    for (uint32_t s = 0; s < sizeof(writeSizes) / sizeof(writeSizes[0]); s++) {
+        enumDriver.restart();
+        uint32_t start = readCoreTimer();
+        while (enumDriver.bytes < BENCH_BYTES) {
+            enumSerial.write(data, writeSizes[s]);
+        }
+        uint32_t elapsed = readCoreTimer() - start;
+        report("cdc_write", writeSizes[s], perSecond(enumDriver.bytes, elapsed), "B/s");
+    }
+
+    for (uint32_t s = 0; s < sizeof(readSizes) / sizeof(readSizes[0]); s++) {
+        uint32_t read = 0;
+        uint32_t start = readCoreTimer();
+        while (read < BENCH_BYTES) {
+            EnumUSB.onOutPacket(enumDriver.bulkRx, data, readSizes[s]);
+            while (enumSerial.available()) {
+                enumSerial.read();
+                read++;
+            }
+        }
+        uint32_t elapsed = readCoreTimer() - start;
+        report("cdc_read", readSizes[s], perSecond(read, elapsed), "B/s");
+    }
+}
+
+// Reports per second through each HID device's API, and the time from the
+// call until its first report reaches the driver.
+void reportHID(const char *rate, const char *delay, uint32_t elapsed, uint32_t latency) {
+    report(rate, 0, perSecond(enumDriver.packets, elapsed), "reports/s");
+    report(delay, 0, latency * 2 / BENCH_ITERATIONS, "cycles");
+}
+
+void benchmarkHID() {
+    uint32_t latency = 0;
+    enumDriver.restart();
+    uint32_t start = readCoreTimer();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        enumDriver.timing = true;
+        uint32_t t = readCoreTimer();
+        enumKeyboard.print('a');    // Press and release
+        latency += enumDriver.sendTime - t;
+    }
+    reportHID("keyboard_print_rate", "keyboard_print_latency", readCoreTimer() - start, latency);
+
+    latency = 0;
+    enumDriver.restart();
+    start = readCoreTimer();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        enumDriver.timing = true;
+        uint32_t t = readCoreTimer();
+        enumMouse.move(1, -1, 0);
+        latency += enumDriver.sendTime - t;
+    }
+    reportHID("mouse_move_rate", "mouse_move_latency", readCoreTimer() - start, latency);
+
+    latency = 0;
+    enumDriver.restart();
+    start = readCoreTimer();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        enumDriver.timing = true;
+        uint32_t t = readCoreTimer();
+        enumJoystick.setPosition(i, i >> 8, 127);
+        latency += enumDriver.sendTime - t;
+    }
+    reportHID("joystick_position_rate", "joystick_position_latency", readCoreTimer() - start, latency);
+}
+
+void benchmarkMIDI() {
+    enumDriver.restart();
+    uint32_t start = readCoreTimer();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        enumMIDI.sendMessage(0, 0x09, 0x90, i & 0x7F, 64);  // Note on
+    }
+    uint32_t elapsed = readCoreTimer() - start;
+    report("midi_send", 0, perSecond(enumDriver.packets, elapsed), "events/s");
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(2000);
+    Serial.println("test,parameter,value,unit");
+    benchmarkDispatch();
+
+    EnumUSB.addDevice(enumSerial);
+    EnumUSB.addDevice(enumKeyboard);
+    EnumUSB.addDevice(enumMouse);
+    EnumUSB.addDevice(enumJoystick);
+    EnumUSB.addDevice(enumMIDI);
+    EnumUSB.begin();
+    benchmarkEnumeration();
+    benchmarkCDC();
+    benchmarkHID();
+    benchmarkMIDI();
+}
+
+void loop() {
+}
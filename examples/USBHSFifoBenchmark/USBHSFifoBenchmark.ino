@@ -0,0 +1,107 @@
+#include <USB.h>
+
+// Times copying packets to and from a USBHS endpoint FIFO, byte by byte as
+// the driver used to and with USBHS::readFifo() / writeFifo(). PIC32MZ only.
+// Results are printed on Serial as CSV lines:
+//
+//     test,parameter,value,unit
+//
+// No host needs to be attached. Endpoint 7 is set up with 512 byte FIFOs and
+// the TX FIFO is flushed between runs; what is read from the empty RX FIFO is
+// thrown away.
+
+#if !defined(__PIC32MZ__)
+#error This benchmark needs a PIC32MZ
+#endif
+
+#define BENCH_ITERATIONS 1000
+#define BENCH_EP 7
+
+USBHS usbDriver;
+USBManager USB(usbDriver, 0xDEAD, 0xBEEF);
+
+uint8_t epBuffer[512] __attribute__((aligned(16)));
+uint8_t data[512] __attribute__((aligned(4)));
+
+void report(const char *test, uint32_t param, uint32_t value, const char *unit) {
+    Serial.print(test);
+    Serial.print(",");
+    Serial.print(param);
+    Serial.print(",");
+    Serial.print(value);
+    Serial.print(",");
+    Serial.println(unit);
+}
+
+void flushTx() {
+    USBCSR3bits.ENDPOINT = BENCH_EP;
+    USBIENCSR0bits.FLUSH = 1;
+}
+
+// The core timer ticks once every two CPU cycles
+uint32_t cycles(uint32_t start) {
+    return (readCoreTimer() - start) * 2 / BENCH_ITERATIONS;
+}
+
+void benchmarkWrite(uint32_t len) {
+    volatile uint8_t *fifo8 = (volatile uint8_t *)&USBFIFO7;
+    uint32_t start;
+    uint32_t total;
+
+    total = 0;
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        start = readCoreTimer();
+        for (uint32_t i = 0; i < len; i++) {
+            *fifo8 = data[i];
+        }
+        total += readCoreTimer() - start;
+        flushTx();
+    }
+    report("fifo-write-byte", len, total * 2 / BENCH_ITERATIONS, "cycles");
+
+    total = 0;
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        start = readCoreTimer();
+        USBHS::writeFifo(BENCH_EP, data, len);
+        total += readCoreTimer() - start;
+        flushTx();
+    }
+    report("fifo-write-word", len, total * 2 / BENCH_ITERATIONS, "cycles");
+}
+
+void benchmarkRead(uint32_t len) {
+    volatile uint8_t *fifo8 = (volatile uint8_t *)&USBFIFO7;
+    uint32_t start;
+
+    start = readCoreTimer();
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        for (uint32_t i = 0; i < len; i++) {
+            data[i] = *(fifo8 + (i & 3));
+        }
+    }
+    report("fifo-read-byte", len, cycles(start), "cycles");
+
+    start = readCoreTimer();
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        USBHS::readFifo(BENCH_EP, data, len);
+    }
+    report("fifo-read-word", len, cycles(start), "cycles");
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(2000);
+    USB.begin();
+    usbDriver.addEndpoint(BENCH_EP, EP_OUT, EP_BLK, 512, epBuffer, epBuffer);
+    usbDriver.addEndpoint(BENCH_EP, EP_IN, EP_BLK, 512, epBuffer, epBuffer);
+
+    Serial.println("test,parameter,value,unit");
+    static const uint32_t sizes[] = { 8, 64, 512 };
+    for (int i = 0; i < 3; i++) {
+        benchmarkWrite(sizes[i]);
+        benchmarkRead(sizes[i]);
+    }
+}
+
+void loop() {
+}
@@ -0,0 +1,108 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+volatile uint32_t DEVID = 0;
+volatile uint32_t DEVCFG3 = 0;
+
+HostSerial Serial;
+
+static uint64_t nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t _start = nanoseconds();
+
+uint32_t millis() {
+    return (nanoseconds() - _start) / 1000000ULL;
+}
+
+uint32_t micros() {
+    return (nanoseconds() - _start) / 1000ULL;
+}
+
+uint32_t readCoreTimer() {
+    return (nanoseconds() - _start) * (F_CPU / 2 / 1000000ULL) / 1000ULL;
+}
+
+void delay(uint32_t ms) {
+    usleep(ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us) {
+    usleep(us);
+}
+
+uint32_t disableInterrupts() {
+    return 0;
+}
+
+void restoreInterrupts(uint32_t __attribute__((unused)) status) {
+}
+
+// There is no task scheduler, so callers fall back to polling
+int createTask(void __attribute__((unused)) (*task)(int, void *), unsigned long __attribute__((unused)) period, unsigned short __attribute__((unused)) state, void __attribute__((unused)) *var) {
+    return -1;
+}
+
+void destroyTask(int __attribute__((unused)) id) {
+}
+
+void executeSoftReset(uint32_t __attribute__((unused)) options) {
+    fprintf(stderr, "executeSoftReset()\n");
+    exit(1);
+}
+
+void pinMode(uint8_t __attribute__((unused)) pin, uint8_t __attribute__((unused)) mode) {
+}
+
+void digitalWrite(uint8_t __attribute__((unused)) pin, uint8_t __attribute__((unused)) val) {
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+        n += write(*buffer++);
+    }
+    return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+    char buf[8 * sizeof(long) + 1];
+    char *str = &buf[sizeof(buf) - 1];
+
+    if (base < 2) base = 10;
+    *str = 0;
+    do {
+        uint8_t d = n % base;
+        n /= base;
+        *--str = d < 10 ? '0' + d : 'A' + d - 10;
+    } while (n);
+    return write(str);
+}
+
+size_t Print::print(long n, int base) {
+    if ((base == 10) && (n < 0)) {
+        return print('-') + printNumber(-(unsigned long)n, 10);
+    }
+    return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+    return printNumber(n, base);
+}
+
+size_t HostSerial::write(uint8_t c) {
+    return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size) {
+    return fwrite(buffer, 1, size, stdout);
+}
+
+void HostSerial::flush() {
+    fflush(stdout);
+}
@@ -0,0 +1,119 @@
+/*
+ * Just enough of the chipKIT core to build the USB stack on a PC against
+ * USBSimDriver. Interrupts don't exist here, so the interrupt calls do
+ * nothing, and the core timer is made up from the system clock.
+ */
+
+#ifndef _ARDUINO_H
+#define _ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define F_CPU 80000000UL
+#define CORE_TICK_RATE (F_CPU / 2 / 1000)
+
+#define __USER_ISR
+#define _BOARD_NAME_ "Host"
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+
+#define TASK_ENABLE 1
+#define ENTER_BOOTLOADER_ON_BOOT 1
+
+extern volatile uint32_t DEVID;
+extern volatile uint32_t DEVCFG3;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+// The core timer runs at half the CPU clock
+uint32_t readCoreTimer();
+#define _CP0_GET_COUNT() readCoreTimer()
+
+uint32_t disableInterrupts();
+void restoreInterrupts(uint32_t status);
+
+int createTask(void (*task)(int, void *), unsigned long period, unsigned short state, void *var);
+void destroyTask(int id);
+
+void executeSoftReset(uint32_t options);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+
+class Print {
+    private:
+        int _writeError;
+        size_t printNumber(unsigned long n, uint8_t base);
+
+    public:
+        Print() : _writeError(0) {}
+        virtual ~Print() {}
+
+        int getWriteError() { return _writeError; }
+        void clearWriteError() { _writeError = 0; }
+        void setWriteError(int err = 1) { _writeError = err; }
+
+        virtual size_t write(uint8_t) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size);
+        size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+        size_t print(const char *str) { return write(str); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+        size_t print(int n, int base = DEC) { return print((long)n, base); }
+        size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+        size_t print(long n, int base = DEC);
+        size_t print(unsigned long n, int base = DEC);
+
+        size_t println() { return write("\r\n"); }
+        template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+        template <typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+        virtual void flush() = 0;
+};
+
+// Serial goes to stdout
+class HostSerial : public Stream {
+    public:
+        void begin(uint32_t __attribute__((unused)) baud) {}
+        size_t write(uint8_t c);
+        size_t write(const uint8_t *buffer, size_t size);
+        using Print::write;
+        int available() { return 0; }
+        int read() { return -1; }
+        int peek() { return -1; }
+        void flush();
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,223 @@
+// Benchmarks for the device classes, run against the simulated driver with
+// this program playing the host. Results are printed as CSV lines in the
+// same format as examples/USBBenchmark:
+//
+//     test,parameter,value,unit
+//
+// Times include the host's side of each transaction, so compare results
+// from the same machine only.
+
+#include <USB.h>
+#include <stdio.h>
+
+#define BENCH_BYTES (1024 * 1024)
+#define BENCH_REPORTS 20000
+#define BENCH_ENUMERATIONS 1000
+
+USBSimDriver usbDriver;
+USBManager USB(usbDriver, 0xDEAD, 0xBEEF, "Majenko Technologies", "USB Benchmark");
+CDCACM uSerial;
+HID_Keyboard Keyboard;
+HID_Mouse Mouse;
+HID_Joystick Joystick;
+Audio_MIDI MIDI;
+
+// Endpoints found in the configuration descriptor
+static uint8_t cdcIn, cdcOut;
+static uint8_t hidIn[3];
+static uint8_t midiIn;
+
+static uint8_t buffer[4096];
+
+static void report(const char *test, uint32_t param, uint64_t value, const char *unit) {
+    printf("%s,%u,%llu,%s\n", test, param, (unsigned long long)value, unit);
+}
+
+static int request(uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint16_t length, uint8_t *data) {
+    uint8_t setup[8] = {
+        type, req,
+        (uint8_t)(value & 0xFF), (uint8_t)(value >> 8),
+        (uint8_t)(index & 0xFF), (uint8_t)(index >> 8),
+        (uint8_t)(length & 0xFF), (uint8_t)(length >> 8)
+    };
+    return usbDriver.controlTransfer(setup, data, length);
+}
+
+// Take everything waiting on an IN endpoint. Returns the number of bytes.
+static uint32_t drain(uint8_t ep) {
+    uint32_t total = 0;
+    int r;
+    while ((r = usbDriver.hostIn(ep, buffer, sizeof(buffer))) >= 0) {
+        total += r;
+    }
+    return total;
+}
+
+// Reset, address and configure the device as a host would, and note the
+// endpoints of each function.
+static bool enumerate() {
+    usbDriver.hostReset();
+    if (request(0x80, 0x06, 0x0100, 0, 64, buffer) != 18) return false;
+    request(0x00, 0x05, 1, 0, 0, NULL);
+    if (request(0x80, 0x06, 0x0100, 0, 18, buffer) != 18) return false;
+    int len = request(0x80, 0x06, 0x0200, 0, 9, buffer);
+    if (len != 9) return false;
+    len = request(0x80, 0x06, 0x0200, 0, (buffer[3] << 8) | buffer[2], buffer);
+    if (len < 9) return false;
+
+    uint8_t ifClass = 0;
+    uint8_t hid = 0;
+    for (int i = 0; (i + 1 < len) && (buffer[i] > 0); i += buffer[i]) {
+        if (buffer[i + 1] == 0x04) {
+            ifClass = buffer[i + 5];
+        } else if ((buffer[i + 1] == 0x05) && (buffer[i + 2] & 0x80)) {
+            uint8_t ep = buffer[i + 2] & 0x0F;
+            switch (ifClass) {
+                case 0x0A: cdcIn = ep; break;
+                case 0x03: if (hid < 3) hidIn[hid++] = ep; break;
+                case 0x01: midiIn = ep; break;
+            }
+        } else if (buffer[i + 1] == 0x05) {
+            if (ifClass == 0x0A) cdcOut = buffer[i + 2];
+        }
+    }
+
+    return request(0x00, 0x09, 1, 0, 0, NULL) == 0;
+}
+
+static void benchmarkEnumeration() {
+    uint32_t start = micros();
+    for (int i = 0; i < BENCH_ENUMERATIONS; i++) {
+        enumerate();
+    }
+    uint32_t elapsed = micros() - start;
+    report("enumeration_configured", 0, (uint64_t)elapsed * 1000 / BENCH_ENUMERATIONS, "ns");
+}
+
+// Write in chunks of each size with the host reading as it goes
+static void benchmarkCDCWrite() {
+    static const uint32_t sizes[] = { 1, 8, 64, 256, 1024 };
+    memset(buffer, 'x', sizeof(buffer));
+
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t received = 0;
+        uint32_t start = micros();
+        while (received < BENCH_BYTES) {
+            uSerial.write(buffer, sizes[s]);
+            received += drain(cdcIn);
+        }
+        uint32_t elapsed = micros() - start;
+        report("cdc_write", sizes[s], received * 1000000 / elapsed, "B/s");
+    }
+}
+
+// The host sends packets of each size and the sketch reads a byte at a time
+static void benchmarkCDCRead() {
+    static const uint32_t sizes[] = { 1, 8, 64 };
+    uint8_t packet[64];
+    memset(packet, 'x', sizeof(packet));
+
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t read = 0;
+        uint32_t start = micros();
+        while (read < BENCH_BYTES) {
+            if (usbDriver.hostOut(cdcOut, packet, sizes[s]) == USB_SIM_NAK) {
+                while (uSerial.available()) {
+                    uSerial.read();
+                    read++;
+                }
+            }
+        }
+        uint32_t elapsed = micros() - start;
+        while (uSerial.available()) uSerial.read();
+        report("cdc_read", sizes[s], read * 1000000 / elapsed, "B/s");
+    }
+}
+
+// Report the rate that reports reach the host, and the time from the API
+// call until its report is ready on the endpoint. Calls are too short to
+// time with micros(), so callTime is in core timer ticks.
+static void reportHID(const char *name, uint32_t reports, uint32_t callTime, uint32_t elapsed) {
+    char test[32];
+    snprintf(test, sizeof(test), "%s_rate", name);
+    report(test, 0, (uint64_t)reports * 1000000 / elapsed, "reports/s");
+    snprintf(test, sizeof(test), "%s_latency", name);
+    report(test, 0, (uint64_t)callTime * 1000000000 / (F_CPU / 2) / reports, "ns");
+}
+
+static void benchmarkHID() {
+    uint32_t reports = 0;
+    uint32_t callTime = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < BENCH_REPORTS / 2; i++) {
+        uint32_t t = readCoreTimer();
+        Keyboard.print('a');    // Press and release
+        callTime += readCoreTimer() - t;
+        while (usbDriver.hostIn(hidIn[0], buffer, 64) >= 0) {
+            reports++;
+        }
+    }
+    reportHID("keyboard_print", reports, callTime, micros() - start);
+
+    reports = 0;
+    callTime = 0;
+    start = micros();
+    for (int i = 0; i < BENCH_REPORTS; i++) {
+        uint32_t t = readCoreTimer();
+        Mouse.move(1, -1, 0);
+        callTime += readCoreTimer() - t;
+        while (usbDriver.hostIn(hidIn[1], buffer, 64) >= 0) {
+            reports++;
+        }
+    }
+    reportHID("mouse_move", reports, callTime, micros() - start);
+
+    reports = 0;
+    callTime = 0;
+    start = micros();
+    for (int i = 0; i < BENCH_REPORTS; i++) {
+        uint32_t t = readCoreTimer();
+        Joystick.setPosition(i, i >> 8, 127);
+        callTime += readCoreTimer() - t;
+        while (usbDriver.hostIn(hidIn[2], buffer, 64) >= 0) {
+            reports++;
+        }
+    }
+    reportHID("joystick_position", reports, callTime, micros() - start);
+}
+
+static void benchmarkMIDI() {
+    uint32_t events = 0;
+    uint32_t start = micros();
+    for (int i = 0; i < BENCH_REPORTS; i++) {
+        MIDI.sendMessage(0, 0x09, 0x90, i & 0x7F, 64);   // Note on
+        events += drain(midiIn) / 4;
+    }
+    uint32_t elapsed = micros() - start;
+    report("midi_send", 0, (uint64_t)events * 1000000 / elapsed, "events/s");
+}
+
+int main() {
+    USB.addDevice(uSerial);
+    USB.addDevice(Keyboard);
+    USB.addDevice(Mouse);
+    USB.addDevice(Joystick);
+    USB.addDevice(MIDI);
+    USB.begin();
+
+    printf("test,parameter,value,unit\n");
+
+    if (!enumerate()) {
+        fprintf(stderr, "Enumeration failed\n");
+        return 1;
+    }
+    benchmarkEnumeration();
+
+    // Open the serial port: DTR and RTS up
+    request(0x21, 0x22, 0x0003, 0, 0, NULL);
+    benchmarkCDCWrite();
+    benchmarkCDCRead();
+    benchmarkHID();
+    benchmarkMIDI();
+    return 0;
+}
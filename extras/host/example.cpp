@@ -0,0 +1,90 @@
+// Enumerate a CDC/ACM device on the simulated bus and echo some data
+// through it, playing both the host and the sketch.
+
+#include <USB.h>
+#include <stdio.h>
+
+USBSimDriver usbDriver;
+USBManager USB(usbDriver, 0x0403, 0xA662);
+CDCACM uSerial;
+
+static uint8_t buffer[512];
+
+static int request(uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint16_t length, uint8_t *data) {
+    uint8_t setup[8] = {
+        type, req,
+        (uint8_t)(value & 0xFF), (uint8_t)(value >> 8),
+        (uint8_t)(index & 0xFF), (uint8_t)(index >> 8),
+        (uint8_t)(length & 0xFF), (uint8_t)(length >> 8)
+    };
+    return usbDriver.controlTransfer(setup, data, length);
+}
+
+// Find the bulk endpoints in the configuration descriptor
+static bool findBulk(const uint8_t *desc, int len, uint8_t *in, uint8_t *out) {
+    *in = 0;
+    *out = 0;
+    for (int i = 0; i + 1 < len && desc[i] > 0; i += desc[i]) {
+        if ((desc[i + 1] == 0x05) && ((desc[i + 3] & 0x03) == 0x02)) {
+            if (desc[i + 2] & 0x80) {
+                *in = desc[i + 2] & 0x0F;
+            } else {
+                *out = desc[i + 2] & 0x0F;
+            }
+        }
+    }
+    return (*in != 0) && (*out != 0);
+}
+
+int main() {
+    USB.addDevice(uSerial);
+    USB.begin();
+    usbDriver.hostReset();
+
+    int r = request(0x80, 0x06, 0x0100, 0, 18, buffer);
+    if (r != 18) {
+        printf("Device descriptor failed: %d\n", r);
+        return 1;
+    }
+    printf("Device %02x%02x:%02x%02x\n", buffer[9], buffer[8], buffer[11], buffer[10]);
+
+    request(0x00, 0x05, 5, 0, 0, NULL);
+    printf("Address %d\n", usbDriver.getAddress());
+
+    r = request(0x80, 0x06, 0x0200, 0, sizeof(buffer), buffer);
+    uint8_t epIn, epOut;
+    if ((r < 9) || !findBulk(buffer, r, &epIn, &epOut)) {
+        printf("Configuration descriptor failed: %d\n", r);
+        return 1;
+    }
+    printf("Configuration %d bytes, bulk IN %d OUT %d\n", r, epIn, epOut);
+
+    request(0x00, 0x09, 1, 0, 0, NULL);
+
+    // 115200 8N1, then raise DTR so the port counts as open
+    uint8_t coding[7] = { 0x00, 0xC2, 0x01, 0x00, 0x00, 0x00, 0x08 };
+    request(0x21, 0x20, 0, 0, 7, coding);
+    request(0x21, 0x22, 0x0003, 0, 0, NULL);
+
+    const char *msg = "Hello from the host";
+    r = usbDriver.hostOut(epOut, (const uint8_t *)msg, strlen(msg));
+    printf("Sent %d bytes\n", r);
+
+    // The sketch: echo back whatever arrives. Each write() is at least one
+    // packet, so gather it up first rather than filling the FIFO with
+    // single bytes.
+    uint8_t echo[64];
+    uint32_t len = 0;
+    while (uSerial.available() && (len < sizeof(echo))) {
+        echo[len++] = uSerial.read();
+    }
+    uSerial.write(echo, len);
+
+    uint32_t pos = 0;
+    while ((r = usbDriver.hostIn(epIn, buffer + pos, sizeof(buffer) - pos - 1)) > 0) {
+        pos += r;
+    }
+    buffer[pos] = 0;
+    printf("Received %d bytes: %s\n", (int)pos, (char *)buffer);
+    return strcmp((char *)buffer, msg) == 0 ? 0 : 1;
+}
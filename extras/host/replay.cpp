@@ -0,0 +1,558 @@
+// Replay recorded host traffic into the stack through the simulated driver.
+//
+//     replay [-c classes] [-n repeats] [-d devnum] [-o results.csv]
+//            [-b baseline.csv] [-t percent] capture
+//
+// Before replaying, every device's descriptor is checked: the length from
+// getDescriptorLength() must match what populateConfigurationDescriptor()
+// writes, the descriptors must chain to that length, and the interface
+// count must match. The capture is then run -n times. Each event's result
+// and handling cost are printed as CSV. The cost is the quickest of the
+// runs, which is far steadier than the average:
+//
+//     index,request,event,response,cost_ns
+//
+// With -b the results are compared with a baseline written by an earlier
+// -o run. A different response is a failure, as is an event more than -t
+// percent (default 50), and more than REPLAY_NOISE_NS, slower than in the
+// baseline. Any failure makes the exit status 1.
+//
+// A capture is either a Linux usbmon pcap file (as saved by Wireshark or
+// tcpdump -i usbmonN) or a text file, one event per line:
+//
+//     reset                       bus reset
+//     control 80 06 00 01 ...     a whole control transfer; OUT data
+//     control 21 20 ... : 00 c2   stage after the colon
+//     out 2 : 48 65 6c 6c 6f      one OUT packet on endpoint 2
+//     in 2                        one IN transfer on endpoint 2
+//     task                        run USBManager::task()
+//
+// Blank lines and anything after # are ignored. The classes given with -c
+// (default cdc,keyboard,mouse) must be those of the device the capture was
+// taken from, in the same order, so the endpoint numbers match.
+
+#include <USB.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_EVENTS 4096
+#define REPLAY_MAX_DEVICES 16
+#define REPLAY_MAX_DATA 4096
+#define REPLAY_LINE 16384
+
+// Slowdowns smaller than this are timer and cache noise, whatever the ratio
+#define REPLAY_NOISE_NS 100
+
+#define EV_RESET 0
+#define EV_CONTROL 1
+#define EV_OUT 2
+#define EV_IN 3
+#define EV_TASK 4
+
+struct replayEvent {
+    uint8_t type;
+    uint8_t ep;
+    uint8_t setup[8];
+    uint8_t *data;
+    uint32_t length;
+    uint32_t request;           // Number of the control transfer this belongs to
+
+    int result;                 // From the first run
+    uint8_t *response;
+    uint32_t responseLength;
+    uint32_t ticks;             // Quickest of all the runs
+};
+
+struct replayDevice {
+    const char *name;
+    USBDevice *device;
+};
+
+static struct replayEvent events[REPLAY_MAX_EVENTS];
+static uint32_t eventCount = 0;
+
+static struct replayDevice devices[REPLAY_MAX_DEVICES];
+static uint32_t deviceCount = 0;
+
+static USBSimDriver usbDriver;
+static USBManager USB(usbDriver, 0xDEAD, 0xBEEF, "Majenko Technologies", "USB Replay");
+
+static uint8_t scratch[REPLAY_MAX_DATA];
+
+static struct replayEvent *addEvent(uint8_t type) {
+    if (eventCount >= REPLAY_MAX_EVENTS) {
+        fprintf(stderr, "Too many events (max %d)\n", REPLAY_MAX_EVENTS);
+        exit(2);
+    }
+    struct replayEvent *ev = &events[eventCount++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    return ev;
+}
+
+static void setData(struct replayEvent *ev, const uint8_t *data, uint32_t len) {
+    ev->length = len;
+    if (len > 0) {
+        ev->data = (uint8_t *)malloc(len);
+        memcpy(ev->data, data, len);
+    }
+}
+
+static bool addDevice(const char *name) {
+    USBDevice *dev = NULL;
+    if (!strcmp(name, "cdc")) dev = new CDCACM();
+    else if (!strcmp(name, "keyboard")) dev = new HID_Keyboard();
+    else if (!strcmp(name, "mouse")) dev = new HID_Mouse();
+    else if (!strcmp(name, "joystick")) dev = new HID_Joystick();
+    else if (!strcmp(name, "media")) dev = new HID_Media();
+    else if (!strcmp(name, "raw")) dev = new HID_Raw();
+    else if (!strcmp(name, "midi")) dev = new Audio_MIDI();
+
+    if ((dev == NULL) || (deviceCount >= REPLAY_MAX_DEVICES)) {
+        return false;
+    }
+    devices[deviceCount].name = strdup(name);
+    devices[deviceCount].device = dev;
+    deviceCount++;
+    USB.addDevice(dev);
+    return true;
+}
+
+// Parse hex bytes up to the end of the string. Returns the count or -1.
+static int parseHex(char *str, uint8_t *out, uint32_t max) {
+    uint32_t n = 0;
+    for (char *tok = strtok(str, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        char *end;
+        unsigned long v = strtoul(tok, &end, 16);
+        if ((*end != 0) || (v > 0xFF) || (n >= max)) {
+            return -1;
+        }
+        out[n++] = v;
+    }
+    return n;
+}
+
+static bool loadText(FILE *f, const char *filename) {
+    static char line[REPLAY_LINE];
+    uint32_t lineno = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = strchr(line, '#');
+        if (p) *p = 0;
+
+        char *data = strchr(line, ':');
+        if (data) *data++ = 0;
+
+        char *cmd = strtok(line, " \t\r\n");
+        if (cmd == NULL) continue;
+        char *args = strtok(NULL, "");
+
+        int len = 0;
+        if (data) {
+            len = parseHex(data, scratch, sizeof(scratch));
+            if (len < 0) {
+                fprintf(stderr, "%s:%u: bad data\n", filename, lineno);
+                return false;
+            }
+        }
+
+        if (!strcmp(cmd, "reset")) {
+            addEvent(EV_RESET);
+        } else if (!strcmp(cmd, "task")) {
+            addEvent(EV_TASK);
+        } else if (!strcmp(cmd, "control")) {
+            struct replayEvent *ev = addEvent(EV_CONTROL);
+            if (!args || (parseHex(args, ev->setup, 8) != 8)) {
+                fprintf(stderr, "%s:%u: control needs 8 setup bytes\n", filename, lineno);
+                return false;
+            }
+            setData(ev, scratch, len);
+        } else if (!strcmp(cmd, "out") || !strcmp(cmd, "in")) {
+            struct replayEvent *ev = addEvent(strcmp(cmd, "in") ? EV_OUT : EV_IN);
+            char *end;
+            ev->ep = args ? strtoul(args, &end, 10) : 0;
+            if (!args || (ev->ep == 0) || (ev->ep > 15)) {
+                fprintf(stderr, "%s:%u: bad endpoint\n", filename, lineno);
+                return false;
+            }
+            setData(ev, scratch, len);
+        } else {
+            fprintf(stderr, "%s:%u: unknown event '%s'\n", filename, lineno, cmd);
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Turn a usbmon capture into events. Submissions of control transfers and
+// OUT transfers carry what the host sent; completions of IN transfers show
+// when the host polled. A bus reset isn't captured, so one is added first.
+static bool loadPcap(FILE *f, const char *filename, int devnum) {
+    uint8_t hdr[24];
+    uint8_t rec[16];
+    uint8_t *pkt = (uint8_t *)malloc(65536 + 64);
+
+    if (fread(hdr, 1, 24, f) != 24) return false;
+    uint32_t link = get32(&hdr[20]);
+    uint32_t monSize;
+    if (link == 220) {
+        monSize = 64;
+    } else if (link == 189) {
+        monSize = 48;
+    } else {
+        fprintf(stderr, "%s: not a usbmon capture (link type %u)\n", filename, link);
+        return false;
+    }
+
+    addEvent(EV_RESET);
+
+    while (fread(rec, 1, 16, f) == 16) {
+        uint32_t caplen = get32(&rec[8]);
+        if ((caplen > 65536 + 64) || (fread(pkt, 1, caplen, f) != caplen)) {
+            fprintf(stderr, "%s: truncated record\n", filename);
+            return false;
+        }
+        if (caplen < monSize) continue;
+
+        uint8_t type = pkt[8];
+        uint8_t xfer = pkt[9];
+        uint8_t ep = pkt[10];
+        uint8_t dev = pkt[11];
+        bool hasSetup = pkt[14] == 0;
+        int32_t status = get32(&pkt[28]);
+        uint32_t dataLen = caplen - monSize;
+        uint8_t *data = pkt + monSize;
+
+        if ((devnum >= 0) && (dev != 0) && (dev != devnum)) continue;
+
+        if ((type == 'S') && (xfer == 2) && hasSetup) {
+            struct replayEvent *ev = addEvent(EV_CONTROL);
+            memcpy(ev->setup, &pkt[40], 8);
+            if (!(ev->setup[0] & 0x80)) {
+                setData(ev, data, dataLen);
+            }
+        } else if ((type == 'S') && ((xfer == 1) || (xfer == 3)) && !(ep & 0x80) && (dataLen > 0)) {
+            struct replayEvent *ev = addEvent(EV_OUT);
+            ev->ep = ep & 0x0F;
+            setData(ev, data, dataLen);
+        } else if ((type == 'C') && ((xfer == 1) || (xfer == 3)) && (ep & 0x80) && (status == 0)) {
+            struct replayEvent *ev = addEvent(EV_IN);
+            ev->ep = ep & 0x0F;
+        }
+    }
+    free(pkt);
+    return true;
+}
+
+// Check that each device describes itself consistently
+static int checkDescriptors() {
+    int errors = 0;
+    static uint8_t desc[REPLAY_MAX_DATA + 64];
+
+    for (uint32_t i = 0; i < deviceCount; i++) {
+        USBDevice *dev = devices[i].device;
+        uint16_t expected = dev->getDescriptorLength();
+
+        memset(desc, 0xA5, sizeof(desc));
+        uint32_t written = dev->populateConfigurationDescriptor(desc);
+
+        if (written != expected) {
+            fprintf(stderr, "%s: getDescriptorLength() is %u but populateConfigurationDescriptor() wrote %u\n",
+                devices[i].name, expected, written);
+            errors++;
+        }
+
+        // Bytes past the reported length that have been changed
+        for (uint32_t j = sizeof(desc); j > written; j--) {
+            if (desc[j - 1] != 0xA5) {
+                fprintf(stderr, "%s: populateConfigurationDescriptor() wrote %u bytes but returned %u\n",
+                    devices[i].name, j, written);
+                errors++;
+                break;
+            }
+        }
+
+        uint32_t pos = 0;
+        uint32_t interfaces = 0;
+        while (pos < written) {
+            if ((desc[pos] < 2) || (pos + desc[pos] > written)) {
+                fprintf(stderr, "%s: bad descriptor length %u at offset %u\n", devices[i].name, desc[pos], pos);
+                errors++;
+                break;
+            }
+            if ((desc[pos + 1] == 0x04) && (desc[pos + 3] == 0)) {
+                interfaces++;
+            }
+            pos += desc[pos];
+        }
+
+        if (interfaces != dev->getInterfaceCount()) {
+            fprintf(stderr, "%s: getInterfaceCount() is %u but the descriptor has %u interfaces\n",
+                devices[i].name, dev->getInterfaceCount(), interfaces);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// Read packets from an IN endpoint until a short one or a NAK. The
+// simulated bus runs at full speed, so a full packet is 64 bytes.
+static int readIn(uint8_t ep, uint8_t *data, uint32_t maxlen, uint32_t *got) {
+    int r;
+    *got = 0;
+    while ((r = usbDriver.hostIn(ep, data + *got, maxlen - *got)) >= 0) {
+        *got += r;
+        if ((r < 64) || (*got >= maxlen)) {
+            return 0;
+        }
+    }
+    return (r == USB_SIM_NAK && *got > 0) ? 0 : r;
+}
+
+static void run(bool first) {
+    uint32_t got = 0;
+    int r = 0;
+
+    for (uint32_t i = 0; i < eventCount; i++) {
+        struct replayEvent *ev = &events[i];
+
+        uint32_t start = readCoreTimer();
+        switch (ev->type) {
+            case EV_RESET:
+                usbDriver.hostReset();
+                break;
+            case EV_TASK:
+                USB.task();
+                break;
+            case EV_CONTROL:
+                if (ev->setup[0] & 0x80) {
+                    r = usbDriver.controlTransfer(ev->setup, scratch, sizeof(scratch));
+                    got = (r > 0) ? r : 0;
+                } else {
+                    r = usbDriver.controlTransfer(ev->setup, ev->data, ev->length);
+                    got = 0;
+                }
+                break;
+            case EV_OUT:
+                r = usbDriver.hostOut(ev->ep, ev->data, ev->length);
+                break;
+            case EV_IN:
+                r = readIn(ev->ep, scratch, sizeof(scratch), &got);
+                break;
+        }
+        uint32_t ticks = readCoreTimer() - start;
+        if (first || (ticks < ev->ticks)) {
+            ev->ticks = ticks;
+        }
+
+        if (first) {
+            ev->result = (r < 0) ? r : 0;
+            if ((ev->type == EV_CONTROL || ev->type == EV_IN) && (r >= 0) && (got > 0)) {
+                ev->response = (uint8_t *)malloc(got);
+                memcpy(ev->response, scratch, got);
+                ev->responseLength = got;
+            }
+        }
+    }
+}
+
+static uint64_t toNanoseconds(uint32_t ticks) {
+    return (uint64_t)ticks * 1000000000ULL / (F_CPU / 2);
+}
+
+static void formatHex(char *out, const uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        sprintf(out + i * 2, "%02x", data[i]);
+    }
+    out[len * 2] = 0;
+}
+
+static void formatEvent(char *out, struct replayEvent *ev) {
+    switch (ev->type) {
+        case EV_RESET: strcpy(out, "reset"); break;
+        case EV_TASK: strcpy(out, "task"); break;
+        case EV_CONTROL:
+            strcpy(out, "control ");
+            formatHex(out + 8, ev->setup, 8);
+            break;
+        case EV_OUT: sprintf(out, "out %u", ev->ep); break;
+        case EV_IN: sprintf(out, "in %u", ev->ep); break;
+    }
+}
+
+static void formatResponse(char *out, struct replayEvent *ev) {
+    switch (ev->result) {
+        case USB_SIM_NAK: strcpy(out, "NAK"); return;
+        case USB_SIM_STALL: strcpy(out, "STALL"); return;
+        case USB_SIM_TIMEOUT: strcpy(out, "TIMEOUT"); return;
+    }
+    if (ev->responseLength == 0) {
+        strcpy(out, "-");
+    } else {
+        formatHex(out, ev->response, ev->responseLength);
+    }
+}
+
+// Compare with a baseline file. Returns the number of failures.
+static int compare(const char *filename, uint32_t threshold) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return 1;
+    }
+
+    static char line[REPLAY_LINE];
+    static char event[64];
+    static char response[REPLAY_MAX_DATA * 2 + 16];
+    int failures = 0;
+    uint32_t rows = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        uint32_t index;
+        unsigned long long cost;
+        char *fields[5];
+        char *p = line;
+        int n = 0;
+        while ((n < 5) && ((fields[n] = strsep(&p, ",\r\n")) != NULL)) n++;
+        if ((n < 5) || (sscanf(fields[0], "%u", &index) != 1) || (sscanf(fields[4], "%llu", &cost) != 1)) {
+            continue;           // Header
+        }
+        rows++;
+        if (index >= eventCount) {
+            fprintf(stderr, "%u: in the baseline but not the capture\n", index);
+            failures++;
+            continue;
+        }
+
+        struct replayEvent *ev = &events[index];
+        formatEvent(event, ev);
+        if (strcmp(event, fields[2])) {
+            fprintf(stderr, "%u: the baseline has '%s' but the capture has '%s'\n", index, fields[2], event);
+            failures++;
+            continue;
+        }
+
+        formatResponse(response, ev);
+        if (strcmp(response, fields[3])) {
+            fprintf(stderr, "%u: %s: response was %s, baseline %s\n", index, event, response, fields[3]);
+            failures++;
+        }
+
+        uint64_t now = toNanoseconds(ev->ticks);
+        if ((now > cost * (100 + threshold) / 100) && (now > cost + REPLAY_NOISE_NS)) {
+            fprintf(stderr, "%u: %s: %llu ns, baseline %llu ns\n", index, event, (unsigned long long)now, cost);
+            failures++;
+        }
+    }
+    fclose(f);
+
+    if (rows != eventCount) {
+        fprintf(stderr, "The baseline has %u events but the capture has %u\n", rows, eventCount);
+        failures++;
+    }
+    return failures;
+}
+
+static void results(FILE *out) {
+    static char event[64];
+    static char response[REPLAY_MAX_DATA * 2 + 16];
+
+    fprintf(out, "index,request,event,response,cost_ns\n");
+    for (uint32_t i = 0; i < eventCount; i++) {
+        struct replayEvent *ev = &events[i];
+        formatEvent(event, ev);
+        formatResponse(response, ev);
+        fprintf(out, "%u,%u,%s,%s,%llu\n", i, ev->request, event, response,
+            (unsigned long long)toNanoseconds(ev->ticks));
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: replay [-c classes] [-n repeats] [-d devnum] [-o results.csv] [-b baseline.csv] [-t percent] capture\n");
+    fprintf(stderr, "Classes: cdc keyboard mouse joystick media raw midi\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *classes = "cdc,keyboard,mouse";
+    const char *baseline = NULL;
+    const char *output = NULL;
+    uint32_t repeats = 100;
+    uint32_t threshold = 50;
+    int devnum = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:d:o:b:t:")) != -1) {
+        switch (opt) {
+            case 'c': classes = optarg; break;
+            case 'n': repeats = strtoul(optarg, NULL, 10); break;
+            case 'd': devnum = strtol(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': threshold = strtoul(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if ((optind != argc - 1) || (repeats == 0)) usage();
+
+    char *list = strdup(classes);
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (!addDevice(name)) {
+            fprintf(stderr, "Unknown class '%s'\n", name);
+            usage();
+        }
+    }
+    USB.begin();
+
+    const char *filename = argv[optind];
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return 2;
+    }
+    uint8_t magic[4] = { 0, 0, 0, 0 };
+    size_t n = fread(magic, 1, 4, f);
+    rewind(f);
+    bool ok = ((n == 4) && (get32(magic) == 0xa1b2c3d4)) ? loadPcap(f, filename, devnum) : loadText(f, filename);
+    fclose(f);
+    if (!ok) return 2;
+
+    uint32_t request = 0;
+    for (uint32_t i = 0; i < eventCount; i++) {
+        if (events[i].type == EV_CONTROL) request++;
+        events[i].request = request;
+    }
+
+    int failures = checkDescriptors();
+
+    run(true);
+    for (uint32_t i = 1; i < repeats; i++) {
+        run(false);
+    }
+
+    results(stdout);
+    if (output) {
+        FILE *o = fopen(output, "w");
+        if (!o) {
+            perror(output);
+            return 2;
+        }
+        results(o);
+        fclose(o);
+    }
+
+    if (baseline) {
+        failures += compare(baseline, threshold);
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d failure%s\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,564 @@
+// Checks of the manager and device classes on the simulated bus. Each test
+// builds its own driver, manager and devices, plays the host, and reports
+// anything that doesn't come out as USB 2.0 says it should. Exits non-zero
+// if any check fails.
+
+#include <USB.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static int request(USBSimDriver *drv, uint8_t type, uint8_t req, uint16_t value, uint16_t index, uint16_t length, uint8_t *data) {
+    uint8_t setup[8] = {
+        type, req,
+        (uint8_t)(value & 0xFF), (uint8_t)(value >> 8),
+        (uint8_t)(index & 0xFF), (uint8_t)(index >> 8),
+        (uint8_t)(length & 0xFF), (uint8_t)(length >> 8)
+    };
+    return drv->controlTransfer(setup, data, length);
+}
+
+// Find an endpoint descriptor by address in a configuration descriptor
+static const uint8_t *findEndpoint(const uint8_t *desc, int len, uint8_t address) {
+    for (int i = 0; i + 1 < len && desc[i] > 0; i += desc[i]) {
+        if ((desc[i + 1] == 0x05) && (desc[i + 2] == address)) {
+            return &desc[i];
+        }
+    }
+    return NULL;
+}
+
+// A streaming interface with one isochronous IN endpoint, high-bandwidth
+// when the bus allows it.
+class IsoDevice : public USBDevice {
+    public:
+        USBManager *_manager;
+        uint8_t _if;
+        uint8_t _ep;
+        uint8_t _transactions;
+        uint16_t _maxPacket;
+        bool _added;
+        uint8_t _txA[2048];
+        uint8_t _txB[2048];
+
+        IsoDevice(uint8_t transactions) : _transactions(transactions), _maxPacket(0), _added(false) {}
+
+        uint16_t getDescriptorLength() { return 9 + 7; }
+        uint8_t getInterfaceCount() { return 1; }
+        bool getStringDescriptor(uint8_t idx, uint16_t maxlen) { return false; }
+        uint32_t populateConfigurationDescriptor(uint8_t *buf) {
+            uint8_t i = 0;
+            buf[i++] = 9; buf[i++] = 0x04; buf[i++] = _if; buf[i++] = 0; buf[i++] = 1;
+            buf[i++] = 0xFF; buf[i++] = 0; buf[i++] = 0; buf[i++] = 0;
+            buf[i++] = 7; buf[i++] = 0x05; buf[i++] = 0x80 | _ep; buf[i++] = 0x01;
+            buf[i++] = _maxPacket & 0xFF; buf[i++] = _maxPacket >> 8; buf[i++] = 1;
+            return i;
+        }
+        void initDevice(USBManager *manager) {
+            _manager = manager;
+            _if = _manager->allocateInterface();
+            _ep = _manager->allocateEndpoint();
+        }
+        bool getDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        bool getReportDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        void configureEndpoints() {
+            _added = _manager->addPeriodicEndpoint(_ep, EP_OUT, EP_ISO, 1024, _transactions, _txA, _txB);
+            if (_added) {
+                _maxPacket = USBManager::maxPacketField(1024, _transactions);
+            } else {
+                _manager->addEndpoint(_ep, EP_OUT, EP_ISO, 512, _txA, _txB);
+                _maxPacket = 512;
+            }
+        }
+        bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+        bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+        bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+};
+
+// A two transaction endpoint at high speed: the descriptor carries the
+// multiplier, the bandwidth is reserved, and a whole microframe's data
+// reaches the host.
+static void testHighBandwidth() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    IsoDevice *iso = new IsoDevice(2);
+    drv->setHighSpeed(true);
+    usb->addDevice(iso);
+    usb->begin();
+    drv->hostReset();
+
+    CHECK(iso->_added);
+    CHECK(usb->getPeriodicBandwidth() == 2048);
+
+    uint8_t buf[3072];
+    int r = request(drv, 0x80, 0x06, 0x0200, 0, 255, buf);
+    const uint8_t *ep = findEndpoint(buf, r, 0x80 | iso->_ep);
+    CHECK(ep != NULL);
+    if (ep) {
+        CHECK((ep[4] | (ep[5] << 8)) == 0x0C00);   // 1024 bytes, one extra transaction
+    }
+
+    memset(buf, 0x5A, 2048);
+    CHECK(usb->submitIn(iso->_ep, buf, 2048));
+    CHECK(drv->hostIn(iso->_ep, buf, sizeof(buf)) == 2048);
+
+    // Past 6000 bytes a microframe
+    CHECK(usb->addPeriodicEndpoint(14, EP_OUT, EP_ISO, 1024, 3, iso->_txA, iso->_txB));
+    CHECK(!usb->addPeriodicEndpoint(15, EP_OUT, EP_ISO, 1024, 2, iso->_txA, iso->_txB));
+    CHECK(usb->getPeriodicBandwidth() == 2048 + 3072);
+
+    // Too small a packet for the number of transactions
+    CHECK(!usb->addPeriodicEndpoint(15, EP_OUT, EP_INT, 600, 3, iso->_txA, iso->_txB));
+    CHECK(!usb->addPeriodicEndpoint(15, EP_OUT, EP_INT, 512, 2, iso->_txA, iso->_txB));
+}
+
+// Full speed can't do more than one transaction a frame
+static void testHighBandwidthFullSpeed() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    IsoDevice *iso = new IsoDevice(2);
+    usb->addDevice(iso);
+    usb->begin();
+    drv->hostReset();
+
+    CHECK(!iso->_added);
+    CHECK(iso->_maxPacket == 512);
+    CHECK(usb->getPeriodicBandwidth() == 512);
+}
+
+// Enumerate as far as SET_CONFIGURATION
+static void configure(USBSimDriver *drv) {
+    uint8_t buf[255];
+    drv->hostReset();
+    request(drv, 0x80, 0x06, 0x0100, 0, 18, buf);
+    request(drv, 0x00, 0x05, 5, 0, 0, NULL);
+    request(drv, 0x80, 0x06, 0x0200, 0, sizeof(buf), buf);
+    request(drv, 0x00, 0x09, 1, 0, 0, NULL);
+}
+
+// Host-to-device requests with a data stage are only acknowledged if a
+// device takes them and all the data fitted
+static void testControlOut() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    HID_Raw *hid = new HID_Raw();
+    usb->addDevice(hid);
+    usb->begin();
+    configure(drv);
+
+    uint8_t data[300];
+    memset(data, 0, sizeof(data));
+    data[0] = 3;
+    data[1] = 0x42;
+
+    // SET_REPORT (feature) to the HID interface
+    CHECK(request(drv, 0x21, 0x09, 0x0300, 0, 2, data) == 2);
+    CHECK(request(drv, 0x21, 0x09, 0x0300, 0, 300, data) == USB_SIM_STALL);
+
+    // Nobody handles SET_REPORT (output) or a vendor request
+    CHECK(request(drv, 0x21, 0x09, 0x0200, 0, 1, data) == USB_SIM_STALL);
+    CHECK(request(drv, 0x40, 0x01, 0, 0, 4, data) == USB_SIM_STALL);
+
+    // EP0 still works afterwards
+    uint8_t desc[18];
+    CHECK(request(drv, 0x80, 0x06, 0x0100, 0, 18, desc) == 18);
+}
+
+// A vendor interface with one OUT endpoint that counts what it gets
+class SinkDevice : public USBDevice {
+    public:
+        USBManager *_manager;
+        uint8_t _if;
+        uint8_t _ep;
+        uint8_t _type;
+        uint16_t _size;
+        uint32_t _received;
+        uint32_t _sum;
+        uint8_t _rxA[1024];
+        uint8_t _rxB[1024];
+
+        SinkDevice(uint8_t type = EP_BLK, uint16_t size = 64) : _type(type), _size(size), _received(0), _sum(0) {}
+
+        uint16_t getDescriptorLength() { return 9 + 7; }
+        uint8_t getInterfaceCount() { return 1; }
+        bool getStringDescriptor(uint8_t idx, uint16_t maxlen) { return false; }
+        uint32_t populateConfigurationDescriptor(uint8_t *buf) {
+            uint8_t i = 0;
+            buf[i++] = 9; buf[i++] = 0x04; buf[i++] = _if; buf[i++] = 0; buf[i++] = 1;
+            buf[i++] = 0xFF; buf[i++] = 0; buf[i++] = 0; buf[i++] = 0;
+            buf[i++] = 7; buf[i++] = 0x05; buf[i++] = _ep; buf[i++] = (_type == EP_INT) ? 0x03 : 0x02;
+            buf[i++] = _size & 0xFF; buf[i++] = _size >> 8; buf[i++] = (_type == EP_INT) ? 1 : 0;
+            return i;
+        }
+        void initDevice(USBManager *manager) {
+            _manager = manager;
+            _if = _manager->allocateInterface();
+            _ep = _manager->allocateEndpoint();
+        }
+        bool getDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        bool getReportDescriptor(uint8_t ep, uint8_t target, uint8_t id, uint8_t maxlen) { return false; }
+        void configureEndpoints() {
+            _manager->addEndpoint(_ep, EP_IN, _type, _size, _rxA, _rxB);
+        }
+        bool onSetupPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+        bool onInPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) { return false; }
+        bool onOutPacket(uint8_t ep, uint8_t target, uint8_t *data, uint32_t l) {
+            if (ep != _ep) return false;
+            _received += l;
+            for (uint32_t i = 0; i < l; i++) {
+                _sum += data[i];
+            }
+            return true;
+        }
+};
+
+// With deferred events OUT data the host has been ACKed for is never lost:
+// the endpoint NAKs while the queue is backed up, and carries on once
+// task() has caught up.
+static void testDeferredOut() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    SinkDevice *sink = new SinkDevice();
+    usb->addDevice(sink);
+    usb->setDeferredEvents(true);
+    usb->begin();
+    configure(drv);
+    usb->task();
+
+    uint8_t data[64];
+    memset(data, 0xA5, sizeof(data));
+    uint32_t sent = 0;
+    int naks = 0;
+    for (int i = 0; i < 4 * USB_EVENT_QUEUE_SIZE; i++) {
+        int r = drv->hostOut(sink->_ep, data, sizeof(data));
+        if (r == USB_SIM_NAK) {
+            naks++;
+        } else if (r > 0) {
+            sent += r;
+        }
+    }
+    CHECK(naks > 0);
+    CHECK(usb->getEventOverflows() == 0);
+
+    usb->task();
+    CHECK(sink->_received == sent);
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 64);
+    usb->task();
+    CHECK(sink->_received == sent + 64);
+}
+
+// A packet bigger than a queue slot reaches the device whole, and the
+// endpoint NAKs until it has
+static void testDeferredLargeOut() {
+    USBSimDriver *drv = new USBSimDriver(true);
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    SinkDevice *sink = new SinkDevice(EP_INT, 1024);
+    usb->addDevice(sink);
+    usb->setDeferredEvents(true);
+    usb->begin();
+    configure(drv);
+    usb->task();
+
+    uint8_t data[1024];
+    uint32_t sum = 0;
+    for (int i = 0; i < 1024; i++) {
+        data[i] = i / 4;
+        sum += data[i];
+    }
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 1024);
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == USB_SIM_NAK);
+
+    usb->task();
+    CHECK(sink->_received == 1024);
+    CHECK(sink->_sum == sum);
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 1024);
+    usb->task();
+    CHECK(sink->_received == 2048);
+}
+
+// SET_ADDRESS takes effect as soon as its status stage has gone, without
+// waiting for task()
+static void testDeferredAddress() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    usb->addDevice(new SinkDevice());
+    usb->setDeferredEvents(true);
+    usb->begin();
+    drv->hostReset();
+
+    CHECK(request(drv, 0x00, 0x05, 9, 0, 0, NULL) == 0);
+    CHECK(drv->getAddress() == 9);
+}
+
+// OUT data still queued when the bus is reset is thrown away with the rest
+// of the old session
+static void testDeferredReset() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    SinkDevice *sink = new SinkDevice();
+    usb->addDevice(sink);
+    usb->setDeferredEvents(true);
+    usb->begin();
+    configure(drv);
+    usb->task();
+
+    uint8_t data[64];
+    memset(data, 0, sizeof(data));
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 64);
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 64);
+    configure(drv);
+    usb->task();
+    CHECK(sink->_received == 0);
+
+    CHECK(drv->hostOut(sink->_ep, data, sizeof(data)) == 64);
+    usb->task();
+    CHECK(sink->_received == 64);
+}
+
+// A SETUP still gets through when the queue is full of other events
+static void testDeferredSetup() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    SinkDevice *sink = new SinkDevice();
+    usb->addDevice(sink);
+    usb->setDeferredEvents(true);
+    usb->begin();
+    drv->hostReset();
+
+    uint8_t data[8];
+    for (int i = 0; i < USB_EVENT_QUEUE_SIZE; i++) {
+        usb->onInPacket(1, data, 0);
+    }
+
+    const uint8_t setConfig[8] = { 0x00, 0x09, 1, 0, 0, 0, 0, 0 };
+    drv->hostSetup(setConfig);
+    usb->task();
+    CHECK(usb->getConfiguration() == 1);
+}
+
+static uint32_t abortedLength;
+
+static void recordLength(uint8_t ep, uint32_t len, void *ctx) {
+    abortedLength = len;
+}
+
+// A bus reset ends any transfer still waiting for data
+static void testResetAbortsTransfers() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    SinkDevice *sink = new SinkDevice();
+    usb->addDevice(sink);
+    usb->begin();
+    configure(drv);
+
+    uint8_t buf[128];
+    abortedLength = 0;
+    CHECK(usb->submitOut(sink->_ep, buf, sizeof(buf), recordLength, NULL));
+    drv->hostReset();
+    CHECK(abortedLength == USB_TRANSFER_ABORTED);
+
+    // The endpoint is free for a new transfer
+    CHECK(usb->submitOut(sink->_ep, buf, sizeof(buf), recordLength, NULL));
+}
+
+// With deferred events a reset at a new speed leaves the endpoints and
+// descriptors alone in the interrupt; task() rebuilds them before it
+// answers anything that came after the reset.
+static void testDeferredSpeedChange() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    IsoDevice *iso = new IsoDevice(2);
+    drv->setHighSpeed(true);
+    usb->addDevice(iso);
+    usb->setDeferredEvents(true);
+    usb->begin();
+    drv->hostReset();
+    usb->task();
+    CHECK(usb->getPeriodicBandwidth() == 2048);
+
+    drv->setHighSpeed(false);
+    drv->hostReset();
+    CHECK(usb->getPeriodicBandwidth() == 2048);
+    usb->task();
+    CHECK(usb->getPeriodicBandwidth() == 512);
+
+    uint8_t buf[255];
+    int r = request(drv, 0x80, 0x06, 0x0200, 0, sizeof(buf), buf);
+    const uint8_t *ep = findEndpoint(buf, r, 0x80 | iso->_ep);
+    CHECK(ep != NULL);
+    if (ep) {
+        CHECK((ep[4] | (ep[5] << 8)) == 512);
+    }
+}
+
+// A string a device registers is referenced from its descriptors and
+// served by GET_DESCRIPTOR
+static void testDeviceString() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+    CDCACM *cdc = new CDCACM("Debug Console");
+    usb->addDevice(cdc);
+    usb->begin();
+    configure(drv);
+
+    uint8_t buf[255];
+    int r = request(drv, 0x80, 0x06, 0x0200, 0, sizeof(buf), buf);
+    uint8_t iFunction = 0;
+    uint8_t iInterface = 0;
+    for (int i = 0; i + 1 < r && buf[i] > 0; i += buf[i]) {
+        if (buf[i + 1] == 0x0B) {
+            iFunction = buf[i + 7];
+        } else if ((buf[i + 1] == 0x04) && (buf[i + 5] == 0x02)) {
+            iInterface = buf[i + 8];
+        }
+    }
+    CHECK(iFunction >= 4);
+    CHECK(iInterface == iFunction);
+
+    r = request(drv, 0x80, 0x06, 0x0300 | iFunction, 0x0409, sizeof(buf), buf);
+    const char *name = "Debug Console";
+    CHECK(r == 2 + 2 * (int)strlen(name));
+    CHECK(buf[1] == 0x03);
+    bool same = true;
+    for (uint32_t i = 0; i < strlen(name) && same; i++) {
+        same = (buf[2 + 2 * i] == name[i]) && (buf[3 + 2 * i] == 0);
+    }
+    CHECK(same);
+
+    // Unnamed ports still reference no string
+    USBSimDriver *drv2 = new USBSimDriver();
+    USBManager *usb2 = new USBManager(drv2, 0xDEAD, 0xBEEF);
+    usb2->addDevice(new CDCACM());
+    usb2->begin();
+    configure(drv2);
+    r = request(drv2, 0x80, 0x06, 0x0200, 0, sizeof(buf), buf);
+    for (int i = 0; i + 1 < r && buf[i] > 0; i += buf[i]) {
+        if (buf[i + 1] == 0x0B) {
+            CHECK(buf[i + 7] == 0);
+        }
+    }
+}
+
+// USBHS FIFO RAM: the size code is log2(bytes) - 3, and each endpoint takes
+// the bytes it needs (twice over for bulk while there is room).
+static void testFifoSizing() {
+    CHECK(USBFifoAllocator::sizeCode(8) == 0);
+    CHECK(USBFifoAllocator::sizeCode(64) == 3);
+    CHECK(USBFifoAllocator::sizeCode(512) == 6);
+    CHECK(USBFifoAllocator::sizeCode(1000) == 7);
+    CHECK(USBFifoAllocator::sizeCode(4096) == 9);
+    CHECK(USBFifoAllocator::sizeCode(4097) == USB_FIFO_TOO_BIG);
+
+    USBFifoAllocator fifo;
+    struct USBFifoSlot slot;
+    CHECK(fifo.getUsed() == 64);
+
+    // CDC: an 8 byte interrupt endpoint and a 512 byte bulk pair
+    CHECK(fifo.allocate(8, EP_INT, &slot));
+    CHECK((slot.address == 8) && (slot.sz == 0) && !slot.dpb);
+    CHECK(fifo.allocate(512, EP_BLK, &slot));
+    CHECK((slot.address == 9) && (slot.sz == 6) && slot.dpb);
+    CHECK(fifo.allocate(512, EP_BLK, &slot));
+    CHECK(slot.dpb);
+    CHECK(fifo.getUsed() == 64 + 8 + 1024 + 1024);
+
+    // Another bulk pair: the second half no longer fits twice
+    CHECK(fifo.allocate(512, EP_BLK, &slot));
+    CHECK(slot.dpb);
+    CHECK(fifo.allocate(512, EP_BLK, &slot));
+    CHECK(!slot.dpb);
+    CHECK(fifo.getUsed() == 64 + 8 + 1024 * 3 + 512);
+    CHECK(fifo.getFailures() == 0);
+
+    CHECK(!fifo.allocate(512, EP_BLK, &slot));
+    CHECK(fifo.getFailures() == 1);
+
+    fifo.reset();
+    CHECK(fifo.getUsed() == 64);
+}
+
+// The FIFO for a high-bandwidth endpoint holds all of a microframe's
+// transactions, as USBHS::addPeriodicEndpoint() asks for
+static void testFifoHighBandwidth() {
+    USBFifoAllocator fifo;
+    struct USBFifoSlot slot;
+
+    CHECK(fifo.allocate(1024 * 2, EP_ISO, &slot));
+    CHECK((slot.address == 8) && (slot.sz == 8) && !slot.dpb);
+    CHECK(fifo.getUsed() == 64 + 2048);
+
+    // Room for an interrupt endpoint of the same size as well
+    CHECK(fifo.allocate(1024, EP_INT, &slot));
+    CHECK(fifo.getUsed() == 64 + 2048 + 1024);
+
+    // Three transactions need the whole 4096 bytes
+    fifo.reset();
+    CHECK(!fifo.allocate(1024 * 3, EP_ISO, &slot));
+    CHECK(fifo.getFailures() == 1);
+}
+
+// A small request that overflows into a bigger pool isn't a failure; one
+// that no pool can take is counted once, against the pool it wanted
+static void testPoolFailures() {
+    USBSimDriver *drv = new USBSimDriver();
+    USBManager *usb = new USBManager(drv, 0xDEAD, 0xBEEF);
+
+    struct USBPoolStats tiny, small, large;
+    usb->getPoolStats(USB_POOL_TINY, &tiny);
+    usb->getPoolStats(USB_POOL_SMALL, &small);
+    usb->getPoolStats(USB_POOL_LARGE, &large);
+    uint32_t blocks = tiny.blocks + small.blocks + large.blocks;
+
+    void **bufs = new void *[blocks];
+    uint32_t n = 0;
+    while ((n < blocks) && ((bufs[n] = usb->allocateBuffer(tiny.blockSize)) != NULL)) {
+        n++;
+    }
+    CHECK(n == blocks);
+    CHECK(usb->getAllocationFailures() == 0);
+
+    CHECK(usb->allocateBuffer(tiny.blockSize) == NULL);
+    usb->getPoolStats(USB_POOL_TINY, &tiny);
+    usb->getPoolStats(USB_POOL_SMALL, &small);
+    usb->getPoolStats(USB_POOL_LARGE, &large);
+    CHECK(tiny.failures == 1);
+    CHECK(small.failures == 0);
+    CHECK(large.failures == 0);
+    CHECK(usb->getAllocationFailures() == 1);
+
+    while (n > 0) {
+        usb->releaseBuffer(bufs[--n]);
+    }
+    delete[] bufs;
+}
+
+int main() {
+    testHighBandwidth();
+    testHighBandwidthFullSpeed();
+    testControlOut();
+    testDeferredOut();
+    testDeferredLargeOut();
+    testDeferredSetup();
+    testDeferredAddress();
+    testDeferredReset();
+    testResetAbortsTransfers();
+    testDeferredSpeedChange();
+    testDeviceString();
+    testFifoSizing();
+    testFifoHighBandwidth();
+    testPoolFailures();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}